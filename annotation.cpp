@@ -0,0 +1,285 @@
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <glog/logging.h>
+#include "annotation.h"
+
+namespace caffex {
+
+// Single pass parser that writes shapes straight into an Annotation,
+// without building a json DOM.  Unknown keys are skipped, so it accepts
+// the same input as json11 for the fields we care about.
+class AnnotationParser {
+    char const *p;
+    char const *end;
+    Annotation *anno;
+
+    void ws () {
+        while ((p < end) && ((*p == ' ') || (*p == '\t') || (*p == '\n') || (*p == '\r'))) ++p;
+    }
+    bool expect (char c) {
+        ws();
+        if ((p < end) && (*p == c)) {
+            ++p;
+            return true;
+        }
+        return false;
+    }
+    // reads a string, escapes are kept as is since keys and types never use them
+    bool str (char const **s, size_t *len) {
+        if (!expect('"')) return false;
+        *s = p;
+        while ((p < end) && (*p != '"')) {
+            if (*p == '\\') ++p;
+            ++p;
+        }
+        if (p >= end) return false;
+        *len = p - *s;
+        ++p;
+        return true;
+    }
+    bool num (float *v) {
+        ws();
+        char *e;
+        *v = std::strtof(p, &e);
+        if (e == p) return false;
+        p = e;
+        return true;
+    }
+    bool skip () {
+        ws();
+        if (p >= end) return false;
+        if (*p == '"') {
+            char const *s;
+            size_t l;
+            return str(&s, &l);
+        }
+        if ((*p == '{') || (*p == '[')) {
+            char close = (*p == '{') ? '}' : ']';
+            bool obj = (*p == '{');
+            ++p;
+            if (expect(close)) return true;
+            do {
+                if (obj) {
+                    char const *s;
+                    size_t l;
+                    if (!str(&s, &l) || !expect(':')) return false;
+                }
+                if (!skip()) return false;
+            } while (expect(','));
+            return expect(close);
+        }
+        // number, true, false, null
+        char const *b = p;
+        while ((p < end) && (*p != ',') && (*p != '}') && (*p != ']')
+                && (*p != ' ') && (*p != '\t') && (*p != '\n') && (*p != '\r')) ++p;
+        return p > b;
+    }
+    static bool is (char const *s, size_t l, char const *key) {
+        return (std::strlen(key) == l) && (std::memcmp(s, key, l) == 0);
+    }
+    // calls fn(key, len) for each member, fn must consume the value
+    template <typename F>
+    bool object (F fn) {
+        if (!expect('{')) return false;
+        if (expect('}')) return true;
+        do {
+            char const *s;
+            size_t l;
+            if (!str(&s, &l) || !expect(':')) return false;
+            if (!fn(s, l)) return false;
+        } while (expect(','));
+        return expect('}');
+    }
+    template <typename F>
+    bool array (F fn) {
+        if (!expect('[')) return false;
+        if (expect(']')) return true;
+        do {
+            if (!fn()) return false;
+        } while (expect(','));
+        return expect(']');
+    }
+    bool point () {
+        cv::Point2f pt(0, 0);
+        bool ok = object([this, &pt](char const *s, size_t l) {
+            if (is(s, l, "x")) return num(&pt.x);
+            if (is(s, l, "y")) return num(&pt.y);
+            return skip();
+        });
+        anno->_points.push_back(pt);
+        return ok;
+    }
+    bool shape () {
+        // "type" may come before or after "geometry", so points are
+        // collected first and the shape is decided at the end
+        int type = -1;
+        float x = 0, y = 0, width = 0, height = 0;
+        unsigned begin = anno->_points.size();
+        bool ok = object([&](char const *s, size_t l) {
+            if (is(s, l, "type")) {
+                char const *t;
+                size_t tl;
+                if (!str(&t, &tl)) return false;
+                if (is(t, tl, "rect")) type = Annotation::RECT;
+                else if (is(t, tl, "polygon")) type = Annotation::POLYGON;
+                return true;
+            }
+            if (is(s, l, "geometry")) {
+                return object([&](char const *g, size_t gl) {
+                    if (is(g, gl, "x")) return num(&x);
+                    if (is(g, gl, "y")) return num(&y);
+                    if (is(g, gl, "width")) return num(&width);
+                    if (is(g, gl, "height")) return num(&height);
+                    if (is(g, gl, "points")) return array([this]() { return point(); });
+                    return skip();
+                });
+            }
+            return skip();
+        });
+        if (!ok) return false;
+        if (type == Annotation::RECT) {
+            anno->_points.resize(begin);
+            anno->_points.emplace_back(x, y);
+            anno->_points.emplace_back(x + width, y + height);
+        }
+        else if ((type != Annotation::POLYGON) || (anno->_points.size() == begin)) {
+            anno->_points.resize(begin);
+            return true;
+        }
+        Annotation::Shape sh;
+        sh.type = type;
+        sh.begin = begin;
+        sh.end = anno->_points.size();
+        anno->_shapes.push_back(sh);
+        return true;
+    }
+public:
+    AnnotationParser (string const &txt, Annotation *anno_)
+        : p(txt.data()), end(txt.data() + txt.size()), anno(anno_) {
+    }
+    bool parse () {
+        bool ok = object([this](char const *s, size_t l) {
+            if (is(s, l, "shapes")) return array([this]() { return shape(); });
+            return skip();
+        });
+        ws();
+        return ok && (p == end);
+    }
+};
+
+bool Annotation::parse (string const &txt) {
+    _shapes.clear();
+    _points.clear();
+    AnnotationParser parser(txt, this);
+    if (!parser.parse()) {
+        LOG(ERROR) << "Bad json: " << txt;
+        _shapes.clear();
+        _points.clear();
+        return false;
+    }
+    return true;
+}
+
+void ParseAnnotations (vector<string> const &txts, vector<Annotation> *annos) {
+    annos->resize(txts.size());
+#pragma omp parallel for schedule(dynamic, 64)
+    for (unsigned i = 0; i < txts.size(); ++i) {
+        annos->at(i).parse(txts[i]);
+    }
+}
+
+// first pixel whose center is at or after x
+static inline int first_center (float x) {
+    return int(std::ceil(x - 0.5f));
+}
+
+void Annotation::rasterize (cv::Mat *label, uint8_t v) const {
+    CHECK(label->type() == CV_8UC1);
+    int rows = label->rows;
+    int cols = label->cols;
+    if (_shapes.empty() || (rows == 0) || (cols == 0)) return;
+    // shapes in pixel coordinates, with their row ranges
+    vector<cv::Point2f> pts(_points.size());
+    for (unsigned i = 0; i < pts.size(); ++i) {
+        pts[i].x = _points[i].x * cols;
+        pts[i].y = _points[i].y * rows;
+    }
+    vector<std::pair<int, int>> ranges(_shapes.size());
+    for (unsigned s = 0; s < _shapes.size(); ++s) {
+        Shape const &sh = _shapes[s];
+        float lo = pts[sh.begin].y, hi = lo;
+        for (unsigned i = sh.begin; i < sh.end; ++i) {
+            lo = std::min(lo, pts[i].y);
+            hi = std::max(hi, pts[i].y);
+        }
+        ranges[s].first = std::max(0, first_center(lo));
+        ranges[s].second = std::min(rows, first_center(hi));
+    }
+    vector<float> xs;
+    for (int y = 0; y < rows; ++y) {
+        float yc = y + 0.5f;
+        uint8_t *row = label->ptr<uint8_t>(y);
+        for (unsigned s = 0; s < _shapes.size(); ++s) {
+            if ((y < ranges[s].first) || (y >= ranges[s].second)) continue;
+            Shape const &sh = _shapes[s];
+            xs.clear();
+            if (sh.type == RECT) {
+                xs.push_back(std::min(pts[sh.begin].x, pts[sh.begin + 1].x));
+                xs.push_back(std::max(pts[sh.begin].x, pts[sh.begin + 1].x));
+            }
+            else {
+                // even-odd crossings of the scanline with the polygon edges
+                unsigned n = sh.end - sh.begin;
+                for (unsigned i = 0; i < n; ++i) {
+                    cv::Point2f const &a = pts[sh.begin + i];
+                    cv::Point2f const &b = pts[sh.begin + (i + 1) % n];
+                    if ((a.y <= yc) == (b.y <= yc)) continue;
+                    xs.push_back(a.x + (yc - a.y) * (b.x - a.x) / (b.y - a.y));
+                }
+                std::sort(xs.begin(), xs.end());
+            }
+            for (unsigned i = 0; i + 1 < xs.size(); i += 2) {
+                int x0 = std::max(0, first_center(xs[i]));
+                int x1 = std::min(cols, first_center(xs[i + 1]));
+                if (x1 > x0) {
+                    std::memset(row + x0, v, x1 - x0);
+                }
+            }
+        }
+    }
+}
+
+void Annotation::draw (cv::Mat *m, cv::Scalar v, int thickness) const {
+    if ((thickness == CV_FILLED) && (m->type() == CV_8UC1)) {
+        rasterize(m, cv::saturate_cast<uint8_t>(v[0]));
+        return;
+    }
+    vector<cv::Point> ps;
+    for (auto const &sh: _shapes) {
+        ps.resize(sh.end - sh.begin);
+        for (unsigned i = 0; i < ps.size(); ++i) {
+            auto const &from = _points[sh.begin + i];
+            auto &to = ps[i];
+            to.x = std::round(from.x * m->cols);
+            to.y = std::round(from.y * m->rows);
+        }
+        if (ps.empty()) continue;
+        if (sh.type == RECT) {
+            cv::rectangle(*m, cv::Rect(ps[0], ps[1]), v, thickness);
+            continue;
+        }
+        cv::Point const *pps = &ps[0];
+        int const nps = ps.size();
+        if (thickness == CV_FILLED) {
+            cv::fillPoly(*m, &pps, &nps, 1, v);
+        }
+        else {
+            cv::polylines(*m, &pps, &nps, 1, true, v, thickness);
+        }
+    }
+}
+
+}
+
@@ -0,0 +1,63 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+namespace caffex {
+
+using std::string;
+using std::vector;
+
+// Shapes annotated on an image, in the json format of the image lists:
+//  {"shapes": [{"type": "rect", "geometry": {"x": .., "y": .., "width": .., "height": ..}},
+//              {"type": "polygon", "geometry": {"points": [{"x": .., "y": ..}, ...]}}]}
+// All coordinates are relative to the image size, so an annotation can be
+// drawn at any resolution.  Shapes are kept flat: one array of shapes
+// indexing into one array of points.  A rect is stored as its top-left
+// and bottom-right corners.
+class Annotation {
+public:
+    enum {
+        RECT = 0,
+        POLYGON = 1
+    };
+    struct Shape {
+        int type;
+        unsigned begin, end;    // range in points
+    };
+
+    Annotation () {}
+    // logs an error and leaves the annotation empty if txt is malformed
+    Annotation (string const &txt) {
+        parse(txt);
+    }
+    bool parse (string const &txt);
+
+    vector<Shape> const &shapes () const {
+        return _shapes;
+    }
+    vector<cv::Point2f> const &points () const {
+        return _points;
+    }
+    bool empty () const {
+        return _shapes.empty();
+    }
+
+    // fill all shapes into a CV_8UC1 label image in a single scanline pass;
+    // the annotation is rasterized at the size of *label, e.g. the output
+    // size of an FCN, pixels are set when their centers are inside a shape
+    void rasterize (cv::Mat *label, uint8_t v) const;
+    // draw with OpenCV primitives, outlines if thickness > 0
+    void draw (cv::Mat *m, cv::Scalar v, int thickness = CV_FILLED) const;
+
+private:
+    vector<Shape> _shapes;
+    vector<cv::Point2f> _points;
+    friend class AnnotationParser;
+};
+
+// parse many lines, in parallel
+void ParseAnnotations (vector<string> const &txts, vector<Annotation> *annos);
+
+}
+
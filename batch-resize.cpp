@@ -0,0 +1,173 @@
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/program_options.hpp>
+#include <boost/progress.hpp>
+#include <glog/logging.h>
+#include <opencv2/opencv.hpp>
+
+using namespace std;
+using namespace boost;
+namespace fs = boost::filesystem;
+
+// Reads width and height from the SOF segment of a JPEG file without
+// decoding it, returns false if the file is not a JPEG.
+static bool JpegSize (fs::path const &path, int *width, int *height) {
+    fs::ifstream is(path, ios::binary);
+    unsigned char b[9];
+    if (!is.read(reinterpret_cast<char *>(b), 2)) return false;
+    if ((b[0] != 0xFF) || (b[1] != 0xD8)) return false;
+    for (;;) {
+        int c = is.get();
+        if (c != 0xFF) return false;
+        while (c == 0xFF) c = is.get();     // fill bytes
+        if (c == EOF) return false;
+        // markers without a length
+        if ((c == 0x01) || ((c >= 0xD0) && (c <= 0xD8))) continue;
+        if (!is.read(reinterpret_cast<char *>(b), 2)) return false;
+        int len = (b[0] << 8) | b[1];
+        if (len < 2) return false;
+        // SOF0-SOF15, except DHT, JPG and DAC
+        if ((c >= 0xC0) && (c <= 0xCF) && (c != 0xC4) && (c != 0xC8) && (c != 0xCC)) {
+            if (!is.read(reinterpret_cast<char *>(b), 5)) return false;
+            *height = (b[1] << 8) | b[2];
+            *width = (b[3] << 8) | b[4];
+            return (*width > 0) && (*height > 0);
+        }
+        if (c == 0xDA) return false;        // scan data before any frame
+        is.seekg(len - 2, ios::cur);
+    }
+}
+
+int max_size = 600;
+int quality = 90;
+bool gray = false;
+
+// Resizes one image so its larger side is at most max_size, the same
+// rule as LimitSize in import-images and visualize.  The result is
+// written to a temporary file next to output and renamed, so output
+// either exists complete or not at all.
+static bool Resize (fs::path const &input, fs::path const &output) {
+    int w = 0, h = 0;
+    bool jpeg = JpegSize(input, &w, &h);
+    int flags = gray ? cv::IMREAD_GRAYSCALE : cv::IMREAD_COLOR;
+    if (jpeg && (max_size > 0)) {
+        // let libjpeg decode at 1/2, 1/4 or 1/8 scale as long as the
+        // result stays larger than the target
+        int maxs = std::max(w, h);
+        if (maxs >= max_size * 8) flags = gray ? cv::IMREAD_REDUCED_GRAYSCALE_8 : cv::IMREAD_REDUCED_COLOR_8;
+        else if (maxs >= max_size * 4) flags = gray ? cv::IMREAD_REDUCED_GRAYSCALE_4 : cv::IMREAD_REDUCED_COLOR_4;
+        else if (maxs >= max_size * 2) flags = gray ? cv::IMREAD_REDUCED_GRAYSCALE_2 : cv::IMREAD_REDUCED_COLOR_2;
+    }
+    cv::Mat image = cv::imread(input.native(), flags);
+    if (!image.data) {
+        LOG(ERROR) << "failed to load " << input;
+        return false;
+    }
+    if (!jpeg) {
+        w = image.cols;
+        h = image.rows;
+    }
+    else if ((image.cols > image.rows) != (w > h)) {
+        // rotated by the exif orientation
+        std::swap(w, h);
+    }
+    int maxs = std::max(w, h);
+    fs::path tmp = output.parent_path() / fs::unique_path(".%%%%-%%%%-%%%%" + output.extension().native());
+    if ((max_size > 0) && (maxs > max_size)) {
+        // target size from the original dimensions, as LimitSize computes it
+        cv::Size sz(w * max_size / maxs, h * max_size / maxs);
+        cv::Mat small;
+        cv::resize(image, small, sz, 0, 0, cv::INTER_AREA);
+        image = small;
+    }
+    else if (jpeg && !gray) {
+        // already small enough, keep the original bytes
+        fs::copy_file(input, tmp, fs::copy_option::overwrite_if_exists);
+        fs::rename(tmp, output);
+        return true;
+    }
+    vector<int> params{cv::IMWRITE_JPEG_QUALITY, quality};
+    if (!cv::imwrite(tmp.native(), image, params)) {
+        LOG(ERROR) << "failed to write " << output;
+        fs::remove(tmp);
+        return false;
+    }
+    fs::rename(tmp, output);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    namespace po = boost::program_options;
+    string list_path;
+    fs::path input_dir;
+    fs::path output_dir;
+
+    po::options_description desc("Allowed options");
+    desc.add_options()
+    ("help,h", "produce help message.")
+    ("list", po::value(&list_path), "paths relative to the input directory, stdin if not given")
+    ("input,i", po::value(&input_dir), "input directory")
+    ("output,o", po::value(&output_dir), "output directory, the input structure is kept")
+    ("max", po::value(&max_size)->default_value(max_size), "maximal size of the larger side")
+    ("quality", po::value(&quality)->default_value(quality), "jpeg quality")
+    ("gray", "")
+    ("force", "overwrite existing outputs instead of resuming")
+    ;
+
+    po::positional_options_description p;
+    p.add("input", 1);
+    p.add("output", 1);
+
+    po::variables_map vm;
+    po::store(po::command_line_parser(argc, argv).
+                     options(desc).positional(p).run(), vm);
+    po::notify(vm);
+
+    if (vm.count("help") || input_dir.empty() || output_dir.empty()) {
+        cerr << desc;
+        return 1;
+    }
+    google::InitGoogleLogging(argv[0]);
+    if (vm.count("gray")) gray = true;
+    bool force = vm.count("force") > 0;
+
+    vector<string> paths;
+    {
+        std::ifstream file;
+        if (list_path.size()) {
+            file.open(list_path.c_str());
+            CHECK(file) << "cannot open " << list_path;
+        }
+        istream &is = list_path.size() ? file : cin;
+        string line;
+        while (getline(is, line)) {
+            if (line.empty()) continue;
+            paths.push_back(line);
+        }
+    }
+
+    progress_display progress(paths.size(), cerr);
+    size_t done = 0, skipped = 0, failed = 0;
+#pragma omp parallel for schedule(dynamic, 1) reduction(+:done,skipped,failed)
+    for (unsigned i = 0; i < paths.size(); ++i) {
+        fs::path output = output_dir / paths[i];
+        if (!force && fs::exists(output)) {
+            ++skipped;
+        }
+        else {
+            boost::system::error_code ec;
+            fs::create_directories(output.parent_path(), ec);
+            if (Resize(input_dir / paths[i], output)) ++done;
+            else ++failed;
+        }
+#pragma omp critical
+        ++progress;
+    }
+    cerr << done << " resized, " << skipped << " already done, " << failed << " failed." << endl;
+    return failed ? 1 : 0;
+}
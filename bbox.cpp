@@ -0,0 +1,196 @@
+#include <algorithm>
+#include <sstream>
+#include <glog/logging.h>
+#include "bbox.h"
+
+namespace caffex {
+
+// 8 neighbors, clockwise in image coordinates (y pointing down)
+static const int DX[] = {1, 1, 0, -1, -1, -1, 0, 1};
+static const int DY[] = {0, 1, 1, 1, 0, -1, -1, -1};
+
+static int find (vector<int> &parent, int x) {
+    while (parent[x] != x) {
+        parent[x] = parent[parent[x]];
+        x = parent[x];
+    }
+    return x;
+}
+
+static void unite (vector<int> &parent, int a, int b) {
+    a = find(parent, a);
+    b = find(parent, b);
+    if (a < b) parent[b] = a;
+    else if (b < a) parent[a] = b;
+}
+
+void TraceContour (cv::Mat const &labels, int id, cv::Point start, vector<cv::Point> *contour) {
+    auto inside = [&labels, id](int x, int y) {
+        return (x >= 0) && (y >= 0) && (x < labels.cols) && (y < labels.rows)
+            && (labels.ptr<int>(y)[x] == id);
+    };
+    contour->clear();
+    contour->push_back(start);
+    cv::Point cur = start;
+    int dir = 0;        // pretend we arrived moving east
+    int first = -1;     // first move out of start
+    for (;;) {
+        // resume the clockwise search at the neighbor after the
+        // backtrack, the background pixel we came from
+        int d = (dir + ((dir & 1) ? 6 : 7)) % 8;
+        int k = 0;
+        for (; k < 8; ++k, d = (d + 1) % 8) {
+            if (inside(cur.x + DX[d], cur.y + DY[d])) break;
+        }
+        if (k == 8) break;   // single pixel
+        // back at the start, leaving the way we first did
+        if ((cur == start) && (first >= 0) && (d == first)) {
+            contour->pop_back();
+            break;
+        }
+        if (first < 0) first = d;
+        dir = d;
+        cur.x += DX[d];
+        cur.y += DY[d];
+        contour->push_back(cur);
+        // every pixel is passed at most 4 times
+        CHECK(contour->size() <= 4 * labels.total() + 1) << "contour tracing does not terminate";
+    }
+}
+
+void BBoxDetector::apply (cv::Mat const &prob, vector<BBox> *boxes) const {
+    CHECK(prob.type() == CV_32FC1);
+    boxes->clear();
+    int rows = prob.rows, cols = prob.cols;
+    // threshold, written as a plain loop so the compiler vectorizes it
+    cv::Mat mask(prob.size(), CV_8UC1);
+    for (int y = 0; y < rows; ++y) {
+        float const *p = prob.ptr<float>(y);
+        uint8_t *m = mask.ptr<uint8_t>(y);
+        for (int x = 0; x < cols; ++x) {
+            m[x] = p[x] >= th;
+        }
+    }
+    // one raster pass of provisional labels with union-find
+    cv::Mat labels(prob.size(), CV_32SC1, cv::Scalar(-1));
+    vector<int> parent;
+    for (int y = 0; y < rows; ++y) {
+        uint8_t const *m = mask.ptr<uint8_t>(y);
+        int *l = labels.ptr<int>(y);
+        int const *up = (y > 0) ? labels.ptr<int>(y - 1) : nullptr;
+        for (int x = 0; x < cols; ++x) {
+            if (!m[x]) continue;
+            int n[4] = {-1, -1, -1, -1};
+            if (x > 0) n[0] = l[x - 1];
+            if (up) {
+                if (x > 0) n[1] = up[x - 1];
+                n[2] = up[x];
+                if (x + 1 < cols) n[3] = up[x + 1];
+            }
+            int best = -1;
+            for (int i = 0; i < 4; ++i) {
+                if ((n[i] >= 0) && ((best < 0) || (n[i] < best))) best = n[i];
+            }
+            if (best < 0) {
+                best = parent.size();
+                parent.push_back(best);
+            }
+            else {
+                for (int i = 0; i < 4; ++i) {
+                    if (n[i] >= 0) unite(parent, best, n[i]);
+                }
+            }
+            l[x] = best;
+        }
+    }
+    // resolve to compact ids and collect per region statistics
+    vector<int> compact(parent.size(), -1);
+    unsigned n_regions = 0;
+    for (unsigned i = 0; i < parent.size(); ++i) {
+        int r = find(parent, i);
+        if (compact[r] < 0) compact[r] = n_regions++;
+        compact[i] = compact[r];
+    }
+    struct Region {
+        int x0, y0, x1, y1;
+        double sum;
+        float peak;
+        unsigned area;
+        cv::Point first;
+    };
+    vector<Region> regions(n_regions);
+    for (auto &r: regions) {
+        r.x0 = cols;
+        r.y0 = rows;
+        r.x1 = r.y1 = -1;
+        r.sum = 0;
+        r.peak = 0;
+        r.area = 0;
+    }
+    for (int y = 0; y < rows; ++y) {
+        float const *p = prob.ptr<float>(y);
+        int *l = labels.ptr<int>(y);
+        for (int x = 0; x < cols; ++x) {
+            if (l[x] < 0) continue;
+            int id = l[x] = compact[l[x]];
+            Region &r = regions[id];
+            if (r.area == 0) r.first = cv::Point(x, y);
+            ++r.area;
+            r.sum += p[x];
+            r.peak = std::max(r.peak, p[x]);
+            r.x0 = std::min(r.x0, x);
+            r.x1 = std::max(r.x1, x);
+            r.y0 = std::min(r.y0, y);
+            r.y1 = std::max(r.y1, y);
+        }
+    }
+    vector<cv::Point> contour;
+    for (unsigned id = 0; id < n_regions; ++id) {
+        Region const &r = regions[id];
+        BBox box;
+        box.score = r.sum / r.area;
+        box.peak = r.peak;
+        box.area = r.area;
+        if ((box.peak < keep) || (box.score < sth)) continue;
+        box.box = cv::Rect(r.x0, r.y0, r.x1 - r.x0 + 1, r.y1 - r.y0 + 1);
+        TraceContour(labels, id, r.first, &contour);
+        if (contour.size() > 2) {
+            cv::approxPolyDP(contour, box.polygon, epsilon, true);
+        }
+        else {
+            box.polygon = contour;
+        }
+        boxes->push_back(box);
+    }
+}
+
+string BBoxDetector::json (vector<BBox> const &boxes, cv::Size size, bool polygons) {
+    std::ostringstream ss;
+    float w = size.width, h = size.height;
+    ss << "{\"shapes\":[";
+    for (unsigned i = 0; i < boxes.size(); ++i) {
+        BBox const &b = boxes[i];
+        if (i) ss << ',';
+        if (polygons && (b.polygon.size() >= 3)) {
+            ss << "{\"type\":\"polygon\",\"geometry\":{\"points\":[";
+            for (unsigned j = 0; j < b.polygon.size(); ++j) {
+                if (j) ss << ',';
+                // pixel centers
+                ss << "{\"x\":" << (b.polygon[j].x + 0.5) / w << ",\"y\":" << (b.polygon[j].y + 0.5) / h << '}';
+            }
+            ss << "]}";
+        }
+        else {
+            ss << "{\"type\":\"rect\",\"geometry\":{\"x\":" << b.box.x / w
+               << ",\"y\":" << b.box.y / h
+               << ",\"width\":" << b.box.width / w
+               << ",\"height\":" << b.box.height / h << '}';
+        }
+        ss << ",\"score\":" << b.score << '}';
+    }
+    ss << "]}";
+    return ss.str();
+}
+
+}
+
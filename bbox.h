@@ -0,0 +1,50 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+namespace caffex {
+
+using std::string;
+using std::vector;
+
+// A connected region of a probability map.
+struct BBox {
+    cv::Rect box;
+    float score;        // mean probability over the region
+    float peak;         // max probability
+    unsigned area;      // pixels
+    vector<cv::Point> polygon;  // simplified outer contour
+};
+
+// Moore neighbor tracing of the outer contour of region id in a CV_32SC1
+// label image, starting from its first pixel in raster order (which has
+// no region pixel above it), clockwise in image coordinates.  A pixel
+// is repeated where the contour passes it more than once.
+void TraceContour (cv::Mat const &labels, int id, cv::Point start, vector<cv::Point> *contour);
+
+// Turns a CV_32FC1 probability map, e.g. one channel of the output of
+// Caffex::apply on an FCN model, into regions.
+//  - pixels with probability >= th are foreground
+//  - 8-connected foreground pixels form a region
+//  - a region is kept if its peak reaches keep and its mean reaches sth
+//    (hysteresis: a low th grows regions around confident seeds)
+//  - the outer contour of each region is simplified with tolerance
+//    epsilon pixels
+class BBoxDetector {
+    float th;
+    float keep;
+    float sth;
+    float epsilon;
+public:
+    BBoxDetector (float th_ = 0.5, float keep_ = 0, float sth_ = 0, float epsilon_ = 1.5)
+        : th(th_), keep(keep_), sth(sth_), epsilon(epsilon_) {
+    }
+    void apply (cv::Mat const &prob, vector<BBox> *boxes) const;
+    // Regions as json in the format of the image lists (see Annotation),
+    // with coordinates relative to size, plus a "score" per shape.
+    static string json (vector<BBox> const &boxes, cv::Size size, bool polygons = true);
+};
+
+}
+
@@ -0,0 +1,458 @@
+#define CPU_ONLY 1
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <limits>
+#include <random>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <boost/filesystem.hpp>
+#include <boost/program_options.hpp>
+#include <glog/logging.h>
+#include <opencv2/opencv.hpp>
+#include <caffe/caffe.hpp>
+#include <caffe/util/math_functions.hpp>
+
+using namespace std;
+using namespace boost;
+namespace fs = boost::filesystem;
+
+// Nearest neighbor search over features written by caffex-extract.
+//
+// Distances are computed a block of queries against a block of
+// features at a time: the dot products are one gemm call, so the inner
+// loop runs in the BLAS kernels; L2 distances are recovered from the
+// norms.  For cosine distance all vectors are normalized on load.
+//
+// For large collections an IVF index partitions the features with
+// k-means; a query only scans the features of the --probe partitions
+// whose centers are closest.  The index can be saved and reused.
+
+enum Metric {
+    L2 = 0,
+    COSINE = 1
+};
+
+int metric = L2;
+unsigned query_block = 256;
+unsigned data_block = 4096;
+
+// Rows of dense features.
+struct Features {
+    unsigned dim;
+    vector<int> labels;
+    vector<unsigned> lines;     // line of each row in the file, the id reported
+    vector<float> data;
+    vector<float> norms;     // squared L2 norms
+
+    Features (): dim(0) {}
+    size_t size () const {
+        return labels.size();
+    }
+    float const *row (size_t i) const {
+        return &data[i * dim];
+    }
+    // lines of "label 1:v 2:v ...", as written by caffex-extract;
+    // lines with only a label, images caffex-extract failed to load,
+    // are skipped
+    void load (string const &path) {
+        ifstream is(path.c_str());
+        CHECK(is) << "cannot open " << path;
+        string line;
+        vector<float> row;
+        unsigned n = 0, empty = 0;
+        while (getline(is, line)) {
+            char const *p = line.c_str();
+            char *e;
+            long label = strtol(p, &e, 10);
+            if (e == p) continue;
+            unsigned lineno = n++;
+            p = e;
+            row.clear();
+            for (;;) {
+                long idx = strtol(p, &e, 10);
+                if ((e == p) || (*e != ':')) break;
+                p = e + 1;
+                float v = strtof(p, &e);
+                CHECK(e != p) << "bad line: " << line;
+                p = e;
+                CHECK(idx >= 1) << "bad line: " << line;
+                if (row.size() < size_t(idx)) row.resize(idx, 0);
+                row[idx - 1] = v;
+            }
+            if (row.empty()) {
+                ++empty;
+                continue;
+            }
+            if (dim == 0) dim = row.size();
+            CHECK(row.size() <= dim) << "feature dimension exceeds " << dim << ": " << line;
+            labels.push_back(label);
+            lines.push_back(lineno);
+            data.insert(data.end(), row.begin(), row.end());
+            data.resize(labels.size() * dim, 0);
+        }
+        CHECK(dim > 0) << "no features in " << path;
+        if (empty) LOG(WARNING) << "skipped " << empty << " lines without features in " << path;
+        prepare();
+    }
+    void prepare () {
+        norms.resize(size());
+#pragma omp parallel for
+        for (size_t i = 0; i < size(); ++i) {
+            float *x = &data[i * dim];
+            float s = 0;
+            for (unsigned j = 0; j < dim; ++j) {
+                s += x[j] * x[j];
+            }
+            if ((metric == COSINE) && (s > 0)) {
+                float r = 1.0 / sqrt(s);
+                for (unsigned j = 0; j < dim; ++j) {
+                    x[j] *= r;
+                }
+                s = 1;
+            }
+            norms[i] = s;
+        }
+    }
+};
+
+// k smallest distances seen, kept as a max-heap
+class TopK {
+    unsigned k;
+    vector<pair<float, unsigned>> heap;
+public:
+    TopK (unsigned k_ = 0): k(k_) {
+        heap.reserve(k);
+    }
+    float bound () const {
+        return (heap.size() < k) ? numeric_limits<float>::max() : heap.front().first;
+    }
+    void push (float d, unsigned i) {
+        if (heap.size() < k) {
+            heap.emplace_back(d, i);
+            push_heap(heap.begin(), heap.end());
+        }
+        else if (d < heap.front().first) {
+            pop_heap(heap.begin(), heap.end());
+            heap.back() = make_pair(d, i);
+            push_heap(heap.begin(), heap.end());
+        }
+    }
+    vector<pair<float, unsigned>> sorted () const {
+        vector<pair<float, unsigned>> v(heap);
+        sort(v.begin(), v.end());
+        return v;
+    }
+};
+
+// Distances between nq queries and nx features, both row-major with
+// dim columns, are written to dist (nq x nx).
+static void Distances (float const *q, float const *qnorms, unsigned nq,
+                       float const *x, float const *xnorms, unsigned nx,
+                       unsigned dim, float *dist) {
+    caffe::caffe_cpu_gemm<float>(CblasNoTrans, CblasTrans, nq, nx, dim, 1.0, q, x, 0.0, dist);
+    for (unsigned i = 0; i < nq; ++i) {
+        float *d = dist + size_t(i) * nx;
+        if (metric == COSINE) {
+            for (unsigned j = 0; j < nx; ++j) {
+                d[j] = 1 - d[j];
+            }
+        }
+        else {
+            float qn = qnorms[i];
+            for (unsigned j = 0; j < nx; ++j) {
+                d[j] = max(0.0f, qn + xnorms[j] - 2 * d[j]);
+            }
+        }
+    }
+}
+
+// Scans features [begin, end) of data for queries [qbegin, qend);
+// ids maps a data row to the id reported, skip is the id to ignore
+// for each query (-1 for none).  Distances are squared for L2.
+static void Scan (Features const &queries, unsigned qbegin, unsigned qend,
+                  Features const &data, size_t begin, size_t end,
+                  unsigned const *ids, vector<long> const &skip,
+                  vector<float> *buf, TopK *tops) {
+    unsigned nq = qend - qbegin;
+    for (size_t b = begin; b < end; b += data_block) {
+        unsigned nx = min<size_t>(data_block, end - b);
+        buf->resize(size_t(nq) * nx);
+        Distances(queries.row(qbegin), &queries.norms[qbegin], nq,
+                  data.row(b), &data.norms[b], nx, data.dim, &buf->at(0));
+        for (unsigned i = 0; i < nq; ++i) {
+            float const *d = &buf->at(size_t(i) * nx);
+            TopK &top = tops[i];
+            long self = skip.empty() ? -1 : skip[qbegin + i];
+            float bound = top.bound();
+            for (unsigned j = 0; j < nx; ++j) {
+                if (d[j] >= bound) continue;
+                unsigned id = ids[b + j];
+                if (long(id) == self) continue;
+                top.push(d[j], id);
+                bound = top.bound();
+            }
+        }
+    }
+}
+
+// Inverted file: k-means partitions of the features, each stored
+// contiguously.
+struct IVF {
+    Features centers;
+    vector<size_t> offsets;     // lists + 1
+    vector<unsigned> ids;       // line of each stored feature
+    Features data;              // features in list order
+
+    void build (Features const &all, unsigned lists, unsigned train) {
+        unsigned dim = all.dim;
+        CHECK(lists >= 1);
+        CHECK(all.size() >= lists) << "fewer features than lists";
+        // k-means on a random sample
+        vector<unsigned> sample(all.size());
+        for (unsigned i = 0; i < sample.size(); ++i) sample[i] = i;
+        std::mt19937 rng(1);
+        shuffle(sample.begin(), sample.end(), rng);
+        sample.resize(max(lists, min<unsigned>(train, sample.size())));
+        cv::Mat samples(sample.size(), dim, CV_32FC1);
+        for (unsigned i = 0; i < sample.size(); ++i) {
+            copy(all.row(sample[i]), all.row(sample[i]) + dim, samples.ptr<float>(i));
+        }
+        cv::Mat labels, means;
+        cv::kmeans(samples, lists, labels,
+                   cv::TermCriteria(cv::TermCriteria::COUNT + cv::TermCriteria::EPS, 20, 1e-4),
+                   1, cv::KMEANS_PP_CENTERS, means);
+        centers.dim = dim;
+        centers.labels.assign(lists, 0);
+        centers.data.resize(size_t(lists) * dim);
+        for (unsigned i = 0; i < lists; ++i) {
+            copy(means.ptr<float>(i), means.ptr<float>(i) + dim, &centers.data[size_t(i) * dim]);
+        }
+        centers.prepare();
+        // assign every feature to its nearest center
+        vector<unsigned> assign(all.size());
+#pragma omp parallel
+        {
+            vector<float> dist;
+#pragma omp for schedule(dynamic, 1)
+            for (size_t b = 0; b < all.size(); b += query_block) {
+                unsigned n = min<size_t>(query_block, all.size() - b);
+                dist.resize(size_t(n) * lists);
+                Distances(all.row(b), &all.norms[b], n,
+                          centers.row(0), &centers.norms[0], lists, dim, &dist[0]);
+                for (unsigned i = 0; i < n; ++i) {
+                    float const *d = &dist[size_t(i) * lists];
+                    assign[b + i] = min_element(d, d + lists) - d;
+                }
+            }
+        }
+        offsets.assign(lists + 1, 0);
+        for (unsigned a: assign) ++offsets[a + 1];
+        for (unsigned i = 0; i < lists; ++i) offsets[i + 1] += offsets[i];
+        vector<size_t> next(offsets.begin(), offsets.end() - 1);
+        ids.resize(all.size());
+        data.dim = dim;
+        data.labels.resize(all.size());
+        data.data.resize(all.data.size());
+        data.norms.resize(all.size());
+        for (size_t i = 0; i < all.size(); ++i) {
+            size_t to = next[assign[i]]++;
+            ids[to] = all.lines[i];
+            data.labels[to] = all.labels[i];
+            data.norms[to] = all.norms[i];
+            copy(all.row(i), all.row(i) + dim, &data.data[to * dim]);
+        }
+    }
+
+    // binary layout: metric, dim, lists, size, centers, offsets, ids,
+    // labels, features
+    void save (string const &path) const {
+        FILE *f = fopen(path.c_str(), "wb");
+        PCHECK(f) << "cannot create " << path;
+        uint64_t header[4] = {uint64_t(metric), data.dim, centers.size(), data.size()};
+        CHECK(fwrite(header, sizeof(header), 1, f) == 1);
+        CHECK(fwrite(&centers.data[0], sizeof(float), centers.data.size(), f) == centers.data.size());
+        CHECK(fwrite(&offsets[0], sizeof(size_t), offsets.size(), f) == offsets.size());
+        CHECK(fwrite(&ids[0], sizeof(unsigned), ids.size(), f) == ids.size());
+        CHECK(fwrite(&data.labels[0], sizeof(int), data.labels.size(), f) == data.labels.size());
+        CHECK(fwrite(&data.data[0], sizeof(float), data.data.size(), f) == data.data.size());
+        PCHECK(fclose(f) == 0);
+    }
+
+    void load (string const &path) {
+        FILE *f = fopen(path.c_str(), "rb");
+        PCHECK(f) << "cannot open " << path;
+        uint64_t header[4];
+        CHECK(fread(header, sizeof(header), 1, f) == 1);
+        CHECK(int(header[0]) == metric) << "index was built with another metric";
+        unsigned dim = header[1];
+        unsigned lists = header[2];
+        size_t n = header[3];
+        centers.dim = data.dim = dim;
+        centers.labels.assign(lists, 0);
+        centers.data.resize(size_t(lists) * dim);
+        offsets.resize(lists + 1);
+        ids.resize(n);
+        data.labels.resize(n);
+        data.data.resize(n * dim);
+        CHECK(fread(&centers.data[0], sizeof(float), centers.data.size(), f) == centers.data.size());
+        CHECK(fread(&offsets[0], sizeof(size_t), offsets.size(), f) == offsets.size());
+        CHECK(fread(&ids[0], sizeof(unsigned), ids.size(), f) == ids.size());
+        CHECK(fread(&data.labels[0], sizeof(int), data.labels.size(), f) == data.labels.size());
+        CHECK(fread(&data.data[0], sizeof(float), data.data.size(), f) == data.data.size());
+        fclose(f);
+        // already normalized, only norms are computed
+        int m = metric;
+        metric = L2;
+        centers.prepare();
+        data.prepare();
+        metric = m;
+    }
+};
+
+int main(int argc, char **argv) {
+    namespace po = boost::program_options;
+    string db_path;
+    string query_path;
+    string metric_name;
+    string index_path;
+    unsigned K;
+    unsigned lists;
+    unsigned probe;
+    unsigned train;
+    float max_distance;
+
+    po::options_description desc("Allowed options");
+    desc.add_options()
+    ("help,h", "produce help message.")
+    ("db", po::value(&db_path), "features to search, output of caffex-extract")
+    ("query", po::value(&query_path), "query features, the db itself if not given")
+    (",K", po::value(&K)->default_value(10), "neighbors per query")
+    ("metric", po::value(&metric_name)->default_value("l2"), "l2 or cosine")
+    ("max-distance", po::value(&max_distance)->default_value(numeric_limits<float>::max()), "only report neighbors within this distance")
+    ("ivf", po::value(&lists)->default_value(0), "number of IVF partitions, 0 for exact search")
+    ("probe", po::value(&probe)->default_value(8), "IVF partitions scanned per query")
+    ("train", po::value(&train)->default_value(100000), "features sampled for k-means")
+    ("index", po::value(&index_path), "IVF index file, built and saved if it does not exist")
+    ("query-block", po::value(&query_block)->default_value(query_block), "")
+    ("data-block", po::value(&data_block)->default_value(data_block), "")
+    ;
+
+    po::positional_options_description p;
+    p.add("db", 1);
+    p.add("query", 1);
+
+    po::variables_map vm;
+    po::store(po::command_line_parser(argc, argv).
+                     options(desc).positional(p).run(), vm);
+    po::notify(vm);
+
+    if (vm.count("help") || (db_path.empty() && index_path.empty())) {
+        cerr << desc;
+        return 1;
+    }
+    google::InitGoogleLogging(argv[0]);
+    if (metric_name == "l2") metric = L2;
+    else if (metric_name == "cosine") metric = COSINE;
+    else LOG(FATAL) << "unknown metric " << metric_name;
+    CHECK(K >= 1);
+    CHECK(query_block >= 1);
+    CHECK(data_block >= 1);
+
+    bool use_ivf = (lists > 0) || !index_path.empty();
+    Features db;
+    IVF ivf;
+    if (use_ivf && !index_path.empty() && fs::exists(index_path)) {
+        ivf.load(index_path);
+        LOG(INFO) << "loaded index of " << ivf.data.size() << " features in " << ivf.centers.size() << " lists";
+    }
+    else {
+        CHECK(!db_path.empty()) << "no db";
+        db.load(db_path);
+        LOG(INFO) << "loaded " << db.size() << " features of dimension " << db.dim;
+        if (use_ivf) {
+            CHECK(lists > 0) << "--ivf is needed to build an index";
+            ivf.build(db, lists, train);
+            if (!index_path.empty()) ivf.save(index_path);
+            db = Features();
+        }
+    }
+
+    // queries default to the db itself, matching each item with itself
+    // is then skipped
+    Features queries;
+    vector<long> skip;
+    if (query_path.empty()) {
+        CHECK(!db_path.empty()) << "no queries";
+        if (use_ivf) {
+            queries.load(db_path);
+        }
+        else {
+            queries = db;
+        }
+        skip.assign(queries.lines.begin(), queries.lines.end());
+    }
+    else {
+        queries.load(query_path);
+    }
+    Features const &target = use_ivf ? ivf.data : db;
+    CHECK(queries.dim == target.dim) << "query and db dimensions differ";
+
+    vector<TopK> tops(queries.size(), TopK(K));
+    size_t nq = queries.size();
+#pragma omp parallel
+    {
+        vector<float> buf;
+        vector<float> cdist;
+        vector<unsigned> order;
+#pragma omp for schedule(dynamic, 1)
+        for (size_t qb = 0; qb < nq; qb += query_block) {
+            unsigned qe = min<size_t>(qb + query_block, nq);
+            if (!use_ivf) {
+                Scan(queries, qb, qe, db, 0, db.size(), &db.lines[0], skip, &buf, &tops[qb]);
+                continue;
+            }
+            unsigned lists = ivf.centers.size();
+            unsigned np = min(probe, lists);
+            cdist.resize(size_t(qe - qb) * lists);
+            Distances(queries.row(qb), &queries.norms[qb], qe - qb,
+                      ivf.centers.row(0), &ivf.centers.norms[0], lists, queries.dim, &cdist[0]);
+            order.resize(lists);
+            for (unsigned i = qb; i < qe; ++i) {
+                float const *d = &cdist[size_t(i - qb) * lists];
+                for (unsigned l = 0; l < lists; ++l) order[l] = l;
+                partial_sort(order.begin(), order.begin() + np, order.end(),
+                        [d](unsigned a, unsigned b) { return d[a] < d[b]; });
+                for (unsigned l = 0; l < np; ++l) {
+                    unsigned list = order[l];
+                    Scan(queries, i, i + 1, ivf.data, ivf.offsets[list], ivf.offsets[list + 1],
+                         &ivf.ids[0], skip, &buf, &tops[i]);
+                }
+            }
+        }
+    }
+
+    // query<TAB>label<TAB>id:label:distance ...
+    // ids are line numbers, from 0, in the feature files; the L2
+    // distance is Euclidean, not squared
+    vector<unsigned> const &ids = use_ivf ? ivf.ids : db.lines;
+    vector<int> const &labels = use_ivf ? ivf.data.labels : db.labels;
+    vector<int> label_of(ids.empty() ? 0 : *max_element(ids.begin(), ids.end()) + 1, 0);
+    for (size_t i = 0; i < ids.size(); ++i) label_of[ids[i]] = labels[i];
+    for (size_t i = 0; i < nq; ++i) {
+        cout << queries.lines[i] << '\t' << queries.labels[i] << '\t';
+        bool first = true;
+        for (auto const &n: tops[i].sorted()) {
+            float d = (metric == L2) ? sqrt(n.first) : n.first;
+            if (d > max_distance) break;
+            if (!first) cout << ' ';
+            first = false;
+            cout << n.second << ':' << label_of[n.second] << ':' << d;
+        }
+        cout << '\n';
+    }
+    return 0;
+}
@@ -0,0 +1,35 @@
+#include <boost/program_options.hpp>
+#include "caffex.h"
+
+using namespace std;
+using namespace boost;
+
+int main(int argc, char **argv) {
+    namespace po = boost::program_options; 
+    string model_dir;
+    string output_dir;
+
+    po::options_description desc("Allowed options");
+    desc.add_options()
+    ("help,h", "produce help message.")
+    ("model,m", po::value(&model_dir), "classifier model directory")
+    ("output,o", po::value(&output_dir), "output model directory")
+    ;
+
+    po::positional_options_description p;
+    p.add("model", 1);
+    p.add("output", 1);
+
+    po::variables_map vm;
+    po::store(po::command_line_parser(argc, argv).
+                     options(desc).positional(p).run(), vm);
+    po::notify(vm); 
+
+    if (vm.count("help") || model_dir.empty() || output_dir.empty()) {
+        cerr << desc;
+        return 1;
+    }
+    google::InitGoogleLogging(argv[0]);
+    caffex::Caffex::convolutionize(model_dir, output_dir);
+    return 0;
+}
@@ -2,8 +2,8 @@
 // interesting points from two images using
 // various methods.
 #include <boost/program_options.hpp>
-#include <boost/progress.hpp>
 #include "caffex.h"
+#include "metrics.h"
 
 using namespace std;
 using namespace boost;
@@ -17,11 +17,15 @@ struct Job {
 int main(int argc, char **argv) {
     namespace po = boost::program_options; 
     string model_dir;
+    string stats_path;
+    double stats_interval;
 
     po::options_description desc("Allowed options");
     desc.add_options()
     ("help,h", "produce help message.")
     ("model,m", po::value(&model_dir), "model directory")
+    ("stats", po::value(&stats_path), "periodically rewritten metrics file, in the prometheus text format")
+    ("stats-interval", po::value(&stats_interval)->default_value(10), "seconds between metrics updates")
     ;
 
     po::positional_options_description p;
@@ -52,26 +56,47 @@ int main(int argc, char **argv) {
             jobs.push_back(job);
         }
     }
-    progress_display progress(jobs.size(), cerr);
+    auto &metrics = caffex::Metrics::global();
+    caffex::ImageMetrics m(metrics);
+    auto &pending = metrics.gauge("caffex_pending_images", "images not yet started");
+    pending.set(jobs.size());
+    std::unique_ptr<caffex::StatsWriter> stats;
+    if (stats_path.size()) {
+        stats.reset(new caffex::StatsWriter(metrics, stats_path, stats_interval));
+    }
+
+    std::unique_ptr<caffex::Progress> progress(new caffex::Progress(jobs.size(), {&m.images, &m.failures}));
 #pragma omp parallel
     {
         caffex::Caffex ex(model_dir);
 #pragma omp for schedule(dynamic,1)
         for (unsigned i = 0; i < jobs.size(); ++i) {
             auto &job = jobs[i];
-            cv::Mat mat = cv::imread(job.path);
-            if (mat.total() ==0) continue;
+            pending.add(-1);
+            cv::Mat mat;
+            {
+                caffex::Timer timer(m.decode_time);
+                mat = cv::imread(job.path);
+            }
+            if (mat.total() ==0) {
+                LOG(WARNING) << "failed to load " << job.path;
+                m.failures.add();
+                continue;
+            }
             ex.apply(mat, &job.ft);
-#pragma omp critical
-            ++progress;
+            m.images.add();
         }
     }
-    for (auto const &job: jobs) {
-        cout << job.label;
-        for (unsigned i = 0; i < job.ft.size(); ++i) {
-            cout << ' ' << (i+1) << ':' << job.ft[i];
+    progress.reset();
+    {
+        caffex::Timer timer(m.output_time);
+        for (auto const &job: jobs) {
+            cout << job.label;
+            for (unsigned i = 0; i < job.ft.size(); ++i) {
+                cout << ' ' << (i+1) << ':' << job.ft[i];
+            }
+            cout << endl;
         }
-        cout << endl;
     }
 
     return 0;
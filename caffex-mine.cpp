@@ -0,0 +1,233 @@
+// Hard example mining.  Runs a model over an import-images list and
+// writes the list back with a third column, the number of copies
+// import-images puts in each training pass, proportional to how badly
+// the model does on the sample:
+//      url<TAB>anno<TAB>weight
+// Difficulty is 1 - IoU of the thresholded foreground against the
+// annotation, or the mean pixel cross entropy with --metric loss.
+// Import the output with -R 1, or a small -R for extra augmented passes.
+#include <cmath>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/program_options.hpp>
+#include <boost/progress.hpp>
+#include <boost/algorithm/string/split.hpp>
+#include <boost/algorithm/string/classification.hpp>
+#include "caffex.h"
+#include "annotation.h"
+#include "download.h"
+
+using namespace std;
+using namespace boost;
+namespace fs = boost::filesystem;
+
+struct Sample {
+    string url;
+    string anno;
+    float difficulty;   // < 0 if the image failed to load
+    unsigned weight;
+};
+
+// same as in import-images, so the model sees the training resolution
+static void LimitSize (cv::Mat input, int max_size, cv::Mat *output) {
+    int maxs = std::max(input.cols, input.rows);
+    if ((max_size > 0) && (maxs > max_size)) {
+        cv::resize(input, *output, cv::Size(input.cols * max_size / maxs, input.rows * max_size / maxs));
+    }
+    else {
+        *output = input;
+    }
+}
+
+// prob: foreground probability, label: 0/1
+static float Difficulty (cv::Mat const &prob, cv::Mat const &label, bool loss, float th) {
+    double sum = 0;
+    size_t inter = 0, uni = 0;
+    for (int y = 0; y < prob.rows; ++y) {
+        float const *p = prob.ptr<float>(y);
+        uint8_t const *l = label.ptr<uint8_t>(y);
+        for (int x = 0; x < prob.cols; ++x) {
+            if (loss) {
+                float v = std::min(std::max(l[x] ? p[x] : 1 - p[x], 1e-6f), 1.0f);
+                sum -= std::log(v);
+            }
+            else {
+                bool f = p[x] >= th;
+                inter += f && l[x];
+                uni += f || l[x];
+            }
+        }
+    }
+    if (loss) return sum / prob.total();
+    if (uni == 0) return 0;     // nothing annotated and nothing found
+    return 1.0 - double(inter) / uni;
+}
+
+int main(int argc, char **argv) {
+    namespace po = boost::program_options;
+    string model_dir;
+    string list_path;
+    string metric;
+    float th;
+    int max_size;
+    float replicate;
+    unsigned min_weight, max_weight;
+    caffex::Downloader::Config config;
+    unsigned cache_size;
+    unsigned batch;
+    unsigned prefetch;
+
+    po::options_description desc("Allowed options");
+    desc.add_options()
+    ("help,h", "produce help message.")
+    ("model,m", po::value(&model_dir), "")
+    ("list", po::value(&list_path), "url<TAB>anno lines, stdin if not given")
+    ("metric", po::value(&metric)->default_value("iou"), "iou or loss")
+    ("th", po::value(&th)->default_value(0.5), "foreground threshold for iou")
+    ("max", po::value(&max_size)->default_value(600), "as in import-images")
+    ("replicate,R", po::value(&replicate)->default_value(4), "average weight")
+    ("min", po::value(&min_weight)->default_value(1), "weight of the easiest samples")
+    ("max-weight", po::value(&max_weight)->default_value(16), "")
+    ("batch", po::value(&batch)->default_value(64), "samples scored in parallel at a time")
+    ("prefetch", po::value(&prefetch)->default_value(512), "number of samples to download ahead")
+    ("timeout", po::value(&config.timeout)->default_value(config.timeout), "")
+    ("agent", po::value(&config.agent), "")
+    ("download-threads", po::value(&config.threads)->default_value(config.threads), "concurrent downloads")
+    ("retries", po::value(&config.retries)->default_value(config.retries), "")
+    ("cache", po::value(&config.cache_dir)->default_value(config.cache_dir), "download cache, can be shared with import-images")
+    ("cache-size", po::value(&cache_size)->default_value(0), "cache budget in MB, 0 for unlimited")
+    ("failure-ttl", po::value(&config.failure_ttl)->default_value(config.failure_ttl), "seconds before retrying a failed URL")
+    ("log-level,v", po::value(&FLAGS_minloglevel)->default_value(1), "")
+    ;
+
+    po::positional_options_description p;
+    p.add("model", 1);
+    p.add("list", 1);
+
+    po::variables_map vm;
+    po::store(po::command_line_parser(argc, argv).
+                     options(desc).positional(p).run(), vm);
+    po::notify(vm);
+
+    if (vm.count("help") || model_dir.empty()) {
+        cerr << desc;
+        return 1;
+    }
+    CHECK((metric == "iou") || (metric == "loss")) << "unknown metric " << metric;
+    CHECK(min_weight <= max_weight);
+    if (batch < 1) batch = 1;
+    bool loss = metric == "loss";
+    google::InitGoogleLogging(argv[0]);
+    config.cache_size = uint64_t(cache_size) << 20;
+    caffex::Downloader downloader(config);
+
+    vector<Sample> samples;
+    {
+        std::unique_ptr<fs::ifstream> list_file;
+        if (list_path.size()) {
+            list_file.reset(new fs::ifstream(list_path));
+            CHECK(*list_file) << "cannot open " << list_path;
+        }
+        istream &is = list_file ? *list_file : cin;
+        string line;
+        while (getline(is, line)) {
+            vector<string> ss;
+            split(ss, line, is_any_of("\t"), token_compress_off);
+            // a previous weight is dropped
+            if ((ss.size() != 2) && (ss.size() != 3)) {
+                cerr << "Bad line: " << line << endl;
+                continue;
+            }
+            samples.push_back(Sample{ss[0], ss[1], -1, 1});
+        }
+    }
+    // parsed up front, so bad annotations are reported before the model runs
+    vector<caffex::Annotation> annos;
+    {
+        vector<string> txts;
+        for (auto const &s: samples) {
+            txts.push_back(s.anno);
+        }
+        caffex::ParseAnnotations(txts, &annos);
+    }
+    progress_display progress(samples.size(), cerr);
+    // downloads run ahead of the model by up to `prefetch` samples,
+    // each prefetch pins its file in the cache until it is read
+    unsigned prefetched = 0;
+#pragma omp parallel
+    {
+        // Net is not thread-safe
+        caffex::Caffex ex(model_dir);
+        vector<float> resp;
+        for (unsigned begin = 0; begin < samples.size(); begin += batch) {
+            unsigned end = std::min<unsigned>(begin + batch, samples.size());
+#pragma omp single
+            while ((prefetched < samples.size()) && (prefetched < end + prefetch)) {
+                Sample const &s = samples[prefetched++];
+                if (caffex::IsURL(s.url)) downloader.prefetch(s.url);
+            }
+#pragma omp for schedule(dynamic, 1)
+            for (unsigned i = begin; i < end; ++i) {
+                Sample &s = samples[i];
+                cv::Mat image;
+                if (caffex::IsURL(s.url)) {
+                    image = cv::imread(downloader.fetch(s.url).native(), CV_LOAD_IMAGE_COLOR);
+                    downloader.release(s.url);
+                }
+                else {
+                    image = cv::imread(s.url, CV_LOAD_IMAGE_COLOR);
+                }
+                if (image.data) {
+                    LimitSize(image, max_size, &image);
+                    ex.apply(image, &resp);
+                    cv::Size sz = ex.output_size();
+                    CHECK(resp.size() >= sz.area());
+                    // the model outputs background probabilities first
+                    cv::Mat prob(sz, CV_32F);
+                    for (int y = 0; y < sz.height; ++y) {
+                        float const *from = &resp[y * sz.width];
+                        float *to = prob.ptr<float>(y);
+                        for (int x = 0; x < sz.width; ++x) {
+                            to[x] = 1.0 - from[x];
+                        }
+                    }
+                    cv::Mat label(sz, CV_8UC1, cv::Scalar(0));
+                    annos[i].rasterize(&label, 1);
+                    s.difficulty = Difficulty(prob, label, loss, th);
+                }
+                else {
+                    LOG(ERROR) << "failed to load " << s.url;
+                }
+#pragma omp critical
+                ++progress;
+            }
+        }
+    }
+
+    // weights proportional to difficulty, averaging replicate
+    double sum = 0;
+    unsigned n = 0;
+    for (auto const &s: samples) {
+        if (s.difficulty < 0) continue;
+        sum += s.difficulty;
+        ++n;
+    }
+    double mean = n ? sum / n : 0;
+    size_t total = 0;
+    for (auto &s: samples) {
+        double w = replicate;
+        if (s.difficulty < 0) w = 1;    // keep, it may download next time
+        else if (mean > 0) w = replicate * s.difficulty / mean;
+        s.weight = std::min<long>(std::max<long>(std::lround(w), min_weight), max_weight);
+        total += s.weight;
+        cout << s.url << '\t' << s.anno << '\t' << s.weight << endl;
+    }
+    cerr << n << " of " << samples.size() << " samples scored, mean " << metric
+         << " difficulty " << mean << ", " << total << " copies." << endl;
+    return 0;
+}
@@ -1,7 +1,6 @@
 #include <boost/program_options.hpp>
-#include <boost/progress.hpp>
-#include <xgboost_wrapper.h>
 #include "caffex-xgboost.h"
+#include "metrics.h"
 
 using namespace std;
 using namespace boost;
@@ -16,12 +15,16 @@ int main(int argc, char **argv) {
     namespace po = boost::program_options; 
     string model_dir;
     unsigned batch;
+    string stats_path;
+    double stats_interval;
 
     po::options_description desc("Allowed options");
     desc.add_options()
     ("help,h", "produce help message.")
     ("model,m", po::value(&model_dir), "")
     ("batch,b", po::value(&batch)->default_value(32), "")
+    ("stats", po::value(&stats_path), "periodically rewritten metrics file, in the prometheus text format")
+    ("stats-interval", po::value(&stats_interval)->default_value(10), "seconds between metrics updates")
     ;
 
     po::positional_options_description p;
@@ -44,8 +47,6 @@ int main(int argc, char **argv) {
             jobs.push_back(job);
         }
     }
-    progress_display progress(jobs.size(), cerr);
-
 #if 0   // the code below are for testing
     if (batch == 1) {
 #pragma omp parallel
@@ -59,8 +60,6 @@ int main(int argc, char **argv) {
                 if (image.total() ==0) continue;
                 ex.apply(image, &ft);
                 job.pred = ft[0];
-#pragma omp critical
-                ++progress;
             }
         }
     }
@@ -82,35 +81,60 @@ int main(int argc, char **argv) {
                 jobs[begin + i].pred = pred.ptr<float>(i)[0];
             }
             off = end;
-            progress += end - begin;
         }
     }
 #endif
+    auto &metrics = caffex::Metrics::global();
+    caffex::ImageMetrics m(metrics);
+    auto &pending = metrics.gauge("caffex_pending_batches", "batches not yet started");
+    std::unique_ptr<caffex::StatsWriter> stats;
+    if (stats_path.size()) {
+        stats.reset(new caffex::StatsWriter(metrics, stats_path, stats_interval));
+    }
+
     unsigned nbatch = (jobs.size() + batch -1) / batch;
+    pending.set(nbatch);
+    std::unique_ptr<caffex::Progress> progress(new caffex::Progress(jobs.size(), {&m.images, &m.failures}));
 #pragma omp parallel
     {
         caffex::CaffexBoost ex(model_dir, batch);
         cv::Mat pred;
 #pragma omp for schedule(dynamic,1)
         for (unsigned i = 0; i < nbatch; ++i) {
+            pending.add(-1);
             unsigned begin = i * batch;
             unsigned end = begin + batch;
             if (end > jobs.size()) end = jobs.size();
-            vector<cv::Mat> images(end-begin);
-            for (unsigned i = 0; i < images.size(); ++i) {
-                images[i] = cv::imread(jobs[begin + i].path);
+            // only loaded images are run, failed ones keep pred 0
+            vector<cv::Mat> images;
+            vector<unsigned> loaded;
+            for (unsigned j = begin; j < end; ++j) {
+                caffex::Timer timer(m.decode_time);
+                cv::Mat image = cv::imread(jobs[j].path);
+                if (image.total() == 0) {
+                    LOG(ERROR) << "failed to load " << jobs[j].path;
+                    m.failures.add();
+                    continue;
+                }
+                images.push_back(image);
+                loaded.push_back(j);
             }
-            ex.apply(images, &pred);
-            for (unsigned i = 0; i < images.size(); ++i) {
-                jobs[begin + i].pred = pred.ptr<float>(i)[0];
+            if (images.size()) {
+                ex.apply(images, &pred);
             }
-#pragma omp critical
-            progress += end - begin;
+            for (unsigned k = 0; k < loaded.size(); ++k) {
+                jobs[loaded[k]].pred = pred.ptr<float>(k)[0];
+            }
+            m.images.add(loaded.size());
         }
     }
+    progress.reset();
 
-    for (auto const &job: jobs) {
-        cout << job.pred << '\t' << job.barcode << '\t' << job.path << endl;
+    {
+        caffex::Timer timer(m.output_time);
+        for (auto const &job: jobs) {
+            cout << job.pred << '\t' << job.barcode << '\t' << job.path << endl;
+        }
     }
 
     return 0;
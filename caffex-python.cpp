@@ -0,0 +1,389 @@
+// Python module "caffex", built as caffex.so by Makefile.shared.
+//
+//  import numpy as np, caffex
+//  model = caffex.Caffex("model_dir", batch=1)
+//  out = model.apply(image)        # or a list of up to batch images
+//  prob = np.asarray(out)          # float32, images x channels [x H x W]
+//
+// Images are anything with the buffer protocol, e.g. numpy arrays of
+// H x W or H x W x C uint8 or float32 in BGR order; they are read in
+// place by the preprocessing.  apply returns one Output per output blob
+// (a single Output if there is only one), which exports a view of the
+// blob memory itself.  The view is valid until the next apply, which
+// overwrites it (the memory stays allocated, so old arrays never
+// dangle), and an Output cannot be exported after the next apply or a
+// re-init.  apply(..., copy=True) copies the results into the Outputs
+// instead, which stay valid for good.  The GIL is released
+// during the forward pass, so models on different threads run in
+// parallel; as in the C++ tools, use one model per thread.
+#include <Python.h>
+#include <sys/stat.h>
+#include <cstring>
+#include "caffex.h"
+
+using std::string;
+using std::vector;
+
+namespace {
+
+struct Model {
+    PyObject_HEAD
+    caffex::Caffex *caffex;
+    unsigned generation;    // of the last apply or init
+    unsigned images;        // of the last apply
+    bool running;
+};
+
+struct Output {
+    PyObject_HEAD
+    Model *model;
+    unsigned generation;
+    unsigned blob;
+    float *data;            // copy of the results, with copy=True
+    caffex::shared_ptr<caffex::SyncedMemory> *memory;   // of the exported blob
+    Py_ssize_t shape[4];
+    Py_ssize_t strides[4];
+    int ndim;
+};
+
+extern PyTypeObject ModelType;
+extern PyTypeObject OutputType;
+
+int Output_getbuffer (PyObject *self, Py_buffer *view, int flags) {
+    Output *out = reinterpret_cast<Output *>(self);
+    Model *model = out->model;
+    if ((flags & PyBUF_WRITABLE) == PyBUF_WRITABLE) {
+        PyErr_SetString(PyExc_BufferError, "output is read-only");
+        return -1;
+    }
+    Py_ssize_t len = sizeof(float);
+    for (int i = 0; i < out->ndim; ++i) {
+        len *= out->shape[i];
+    }
+    void const *buf = out->data;
+    if (!buf) {
+        if (model->running) {
+            PyErr_SetString(PyExc_BufferError, "model is running");
+            return -1;
+        }
+        if (out->generation != model->generation) {
+            PyErr_SetString(PyExc_BufferError, "output invalidated by a later apply or init");
+            return -1;
+        }
+        // a reshape may reallocate the blob, the view keeps the old memory
+        if (!out->memory) {
+            out->memory = new caffex::shared_ptr<caffex::SyncedMemory>(model->caffex->outputs()[out->blob]->data());
+        }
+        buf = (*out->memory)->cpu_data();
+    }
+    view->obj = self;
+    Py_INCREF(self);
+    view->buf = const_cast<void *>(buf);
+    view->itemsize = sizeof(float);
+    view->len = len;
+    view->readonly = 1;
+    view->format = ((flags & PyBUF_FORMAT) == PyBUF_FORMAT) ? const_cast<char *>("f") : nullptr;
+    view->ndim = out->ndim;
+    view->shape = ((flags & PyBUF_ND) == PyBUF_ND) ? out->shape : nullptr;
+    view->strides = ((flags & PyBUF_STRIDES) == PyBUF_STRIDES) ? out->strides : nullptr;
+    view->suboffsets = nullptr;
+    view->internal = nullptr;
+    return 0;
+}
+
+void Output_dealloc (PyObject *self) {
+    Output *out = reinterpret_cast<Output *>(self);
+    PyMem_Free(out->data);
+    delete out->memory;
+    Py_DECREF(out->model);
+    Py_TYPE(self)->tp_free(self);
+}
+
+PyBufferProcs Output_buffer = {
+#if PY_MAJOR_VERSION < 3
+    nullptr, nullptr, nullptr, nullptr,
+#endif
+    Output_getbuffer,
+    nullptr
+};
+
+// Wraps a buffer as a cv::Mat header, no pixels are copied.
+bool ImageFromBuffer (Py_buffer const &view, cv::Mat *image) {
+    int depth;
+    string format = view.format ? view.format : "B";
+    if ((format == "B") || (format == "=B") || (format == "<B")) depth = CV_8U;
+    else if ((format == "f") || (format == "=f") || (format == "<f")) depth = CV_32F;
+    else {
+        PyErr_Format(PyExc_TypeError, "image must be uint8 or float32, not '%s'", format.c_str());
+        return false;
+    }
+    if ((view.ndim != 2) && (view.ndim != 3)) {
+        PyErr_SetString(PyExc_ValueError, "image must be H x W or H x W x C");
+        return false;
+    }
+    int rows = view.shape[0], cols = view.shape[1];
+    int channels = (view.ndim == 3) ? view.shape[2] : 1;
+    if ((channels != 1) && (channels != 3) && (channels != 4)) {
+        PyErr_SetString(PyExc_ValueError, "image must have 1, 3 or 4 channels");
+        return false;
+    }
+    // rows may be strided, pixels must be packed
+    if ((view.strides[1] != view.itemsize * channels)
+            || ((view.ndim == 3) && (view.strides[2] != view.itemsize))
+            || (view.strides[0] < view.strides[1] * cols)) {
+        PyErr_SetString(PyExc_ValueError, "image pixels must be contiguous");
+        return false;
+    }
+    *image = cv::Mat(rows, cols, CV_MAKETYPE(depth, channels), view.buf, view.strides[0]);
+    return true;
+}
+
+int Model_init (PyObject *self, PyObject *args, PyObject *kwds) {
+    Model *model = reinterpret_cast<Model *>(self);
+    static char const *keywords[] = {"model_dir", "batch", nullptr};
+    char const *dir;
+    unsigned batch = 1;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|I", const_cast<char **>(keywords), &dir, &batch)) {
+        return -1;
+    }
+    if (batch < 1) {
+        PyErr_SetString(PyExc_ValueError, "batch must be >= 1");
+        return -1;
+    }
+    // Caffex aborts on a bad model, catch the common mistake here
+    struct stat st;
+    string path = string(dir) + "/caffe.model";
+    if (stat(path.c_str(), &st) != 0) {
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, path.c_str());
+        return -1;
+    }
+    if (model->running) {
+        PyErr_SetString(PyExc_RuntimeError, "model is in use");
+        return -1;
+    }
+    delete model->caffex;
+    model->caffex = nullptr;
+    // Outputs of the old model no longer match the blobs
+    ++model->generation;
+    caffex::Caffex *c;
+    Py_BEGIN_ALLOW_THREADS
+    c = new caffex::Caffex(dir, batch);
+    Py_END_ALLOW_THREADS
+    model->caffex = c;
+    return 0;
+}
+
+void Model_dealloc (PyObject *self) {
+    delete reinterpret_cast<Model *>(self)->caffex;
+    Py_TYPE(self)->tp_free(self);
+}
+
+PyObject *Model_new (PyTypeObject *type, PyObject *, PyObject *) {
+    Model *model = reinterpret_cast<Model *>(type->tp_alloc(type, 0));
+    if (model) {
+        model->caffex = nullptr;
+        model->generation = 0;
+        model->images = 0;
+        model->running = false;
+    }
+    return reinterpret_cast<PyObject *>(model);
+}
+
+PyObject *NewOutput (Model *model, unsigned blob, bool copy) {
+    Output *out = PyObject_New(Output, &OutputType);
+    if (!out) return nullptr;
+    Py_INCREF(model);
+    out->model = model;
+    out->generation = model->generation;
+    out->blob = blob;
+    out->data = nullptr;
+    out->memory = nullptr;
+    // the first images rows of the blob, which is batch x ...
+    auto const &b = model->caffex->outputs()[blob];
+    out->ndim = std::min(b->num_axes(), 4);
+    out->shape[0] = model->images;
+    for (int i = 1; i < out->ndim; ++i) {
+        out->shape[i] = b->shape(i);
+    }
+    if (b->num_axes() > 4) {
+        out->shape[3] = b->count(3);    // trailing axes folded
+    }
+    Py_ssize_t stride = sizeof(float);
+    for (int i = out->ndim - 1; i >= 0; --i) {
+        out->strides[i] = stride;
+        stride *= out->shape[i];
+    }
+    if (copy) {
+        out->data = reinterpret_cast<float *>(PyMem_Malloc(stride));
+        if (!out->data) {
+            Py_DECREF(out);
+            return PyErr_NoMemory();
+        }
+        memcpy(out->data, b->cpu_data(), stride);
+    }
+    return reinterpret_cast<PyObject *>(out);
+}
+
+PyObject *Model_apply (PyObject *self, PyObject *args, PyObject *kwds) {
+    Model *model = reinterpret_cast<Model *>(self);
+    static char const *keywords[] = {"images", "copy", nullptr};
+    PyObject *arg;
+    PyObject *copy_arg = nullptr;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|O", const_cast<char **>(keywords), &arg, &copy_arg)) {
+        return nullptr;
+    }
+    bool copy = false;
+    if (copy_arg) {
+        int v = PyObject_IsTrue(copy_arg);
+        if (v < 0) return nullptr;
+        copy = v;
+    }
+    if (!model->caffex) {
+        PyErr_SetString(PyExc_RuntimeError, "model not initialized");
+        return nullptr;
+    }
+    if (model->running) {
+        PyErr_SetString(PyExc_RuntimeError, "model is running in another thread");
+        return nullptr;
+    }
+    // a single image or a list of images
+    vector<PyObject *> objs;
+    if (PyList_Check(arg) || PyTuple_Check(arg)) {
+        Py_ssize_t n = PySequence_Fast_GET_SIZE(arg);
+        for (Py_ssize_t i = 0; i < n; ++i) {
+            objs.push_back(PySequence_Fast_GET_ITEM(arg, i));
+        }
+    }
+    else {
+        objs.push_back(arg);
+    }
+    if (objs.empty() || (int(objs.size()) > model->caffex->batch())) {
+        PyErr_Format(PyExc_ValueError, "between 1 and %d images expected", model->caffex->batch());
+        return nullptr;
+    }
+    vector<Py_buffer> views(objs.size());
+    vector<cv::Mat> images(objs.size());
+    unsigned held = 0;
+    bool ok = true;
+    for (; held < objs.size(); ++held) {
+        if (PyObject_GetBuffer(objs[held], &views[held], PyBUF_RECORDS_RO) != 0) {
+            ok = false;
+            break;
+        }
+        if (!ImageFromBuffer(views[held], &images[held])) {
+            ++held;
+            ok = false;
+            break;
+        }
+        if (images[held].size() != images[0].size()) {
+            // batches of a fully convolutional model share one shape
+            PyErr_SetString(PyExc_ValueError, "all images must be the same size");
+            ++held;
+            ok = false;
+            break;
+        }
+    }
+    if (ok) {
+        model->running = true;
+        Py_BEGIN_ALLOW_THREADS
+        model->caffex->apply(images);
+        Py_END_ALLOW_THREADS
+        model->running = false;
+        ++model->generation;
+        model->images = images.size();
+    }
+    for (unsigned i = 0; i < held; ++i) {
+        PyBuffer_Release(&views[i]);
+    }
+    if (!ok) return nullptr;
+    auto const &outputs = model->caffex->outputs();
+    if (outputs.size() == 1) return NewOutput(model, 0, copy);
+    PyObject *tuple = PyTuple_New(outputs.size());
+    if (!tuple) return nullptr;
+    for (unsigned i = 0; i < outputs.size(); ++i) {
+        PyObject *out = NewOutput(model, i, copy);
+        if (!out) {
+            Py_DECREF(tuple);
+            return nullptr;
+        }
+        PyTuple_SET_ITEM(tuple, i, out);
+    }
+    return tuple;
+}
+
+PyObject *Model_batch (PyObject *self, void *) {
+    Model *model = reinterpret_cast<Model *>(self);
+    return PyLong_FromLong(model->caffex ? model->caffex->batch() : 0);
+}
+
+PyObject *Model_fcn (PyObject *self, void *) {
+    Model *model = reinterpret_cast<Model *>(self);
+    return PyBool_FromLong(model->caffex && model->caffex->is_fcn());
+}
+
+PyMethodDef Model_methods[] = {
+    {"apply", reinterpret_cast<PyCFunction>(Model_apply), METH_VARARGS | METH_KEYWORDS,
+        "apply(image or list of images, copy=False) -> Output or tuple of Outputs"},
+    {nullptr, nullptr, 0, nullptr}
+};
+
+PyGetSetDef Model_getset[] = {
+    {const_cast<char *>("batch"), Model_batch, nullptr, const_cast<char *>("maximal images per apply"), nullptr},
+    {const_cast<char *>("fcn"), Model_fcn, nullptr, const_cast<char *>("fully convolutional"), nullptr},
+    {nullptr, nullptr, nullptr, nullptr, nullptr}
+};
+
+PyTypeObject ModelType = {
+    PyVarObject_HEAD_INIT(nullptr, 0)
+    "caffex.Caffex",
+};
+
+PyTypeObject OutputType = {
+    PyVarObject_HEAD_INIT(nullptr, 0)
+    "caffex.Output",
+};
+
+bool InitTypes () {
+    ModelType.tp_basicsize = sizeof(Model);
+    ModelType.tp_flags = Py_TPFLAGS_DEFAULT;
+    ModelType.tp_doc = "Caffex(model_dir, batch=1)";
+    ModelType.tp_new = Model_new;
+    ModelType.tp_init = Model_init;
+    ModelType.tp_dealloc = Model_dealloc;
+    ModelType.tp_methods = Model_methods;
+    ModelType.tp_getset = Model_getset;
+    OutputType.tp_basicsize = sizeof(Output);
+    OutputType.tp_flags = Py_TPFLAGS_DEFAULT;
+#if PY_MAJOR_VERSION < 3
+    OutputType.tp_flags |= Py_TPFLAGS_HAVE_NEWBUFFER;
+#endif
+    OutputType.tp_doc = "output blob of an apply, with the buffer protocol";
+    OutputType.tp_dealloc = Output_dealloc;
+    OutputType.tp_as_buffer = &Output_buffer;
+    return (PyType_Ready(&ModelType) == 0) && (PyType_Ready(&OutputType) == 0);
+}
+
+}
+
+#if PY_MAJOR_VERSION >= 3
+static PyModuleDef caffex_module = {
+    PyModuleDef_HEAD_INIT, "caffex", "Caffe feature extractor", -1, nullptr
+};
+
+PyMODINIT_FUNC PyInit_caffex () {
+    if (!InitTypes()) return nullptr;
+    PyObject *m = PyModule_Create(&caffex_module);
+    if (!m) return nullptr;
+    Py_INCREF(&ModelType);
+    PyModule_AddObject(m, "Caffex", reinterpret_cast<PyObject *>(&ModelType));
+    return m;
+}
+#else
+PyMODINIT_FUNC initcaffex () {
+    if (!InitTypes()) return;
+    PyObject *m = Py_InitModule3("caffex", nullptr, "Caffe feature extractor");
+    if (!m) return;
+    Py_INCREF(&ModelType);
+    PyModule_AddObject(m, "Caffex", reinterpret_cast<PyObject *>(&ModelType));
+}
+#endif
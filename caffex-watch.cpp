@@ -0,0 +1,315 @@
+// Watches a spool directory and scores images as they arrive.
+// A file is picked up when it is closed after writing or moved into the
+// directory, so writers should either write in place or write elsewhere
+// (or under a name starting with '.') and rename.  Files found by a
+// scan, on startup or after an inotify overflow, may still be open for
+// writing and are only picked up once unmodified for --settle seconds,
+// or on their next close.  Files are batched until there are --batch of
+// them or the oldest has waited --delay milliseconds.  Results are
+// appended as
+//      prediction<TAB>file
+// and flushed after every batch, then the files are added to a journal,
+// which is read on restart so completed files are not scored again.
+// Files that fail to load are not journaled, so they are retried when
+// written again or on restart.
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <climits>
+#include <cerrno>
+#include <cstring>
+#include <chrono>
+#include <ctime>
+#include <deque>
+#include <fstream>
+#include <unordered_set>
+#include <boost/filesystem.hpp>
+#include <boost/program_options.hpp>
+#include "caffex-xgboost.h"
+#include "metrics.h"
+
+using namespace std;
+using namespace boost;
+namespace fs = boost::filesystem;
+typedef std::chrono::steady_clock Clock;
+
+static volatile sig_atomic_t stop = 0;
+
+static void Stop (int) {
+    stop = 1;
+}
+
+// Reads the journal and rewrites it without files no longer in the spool
+// directory, so it does not grow forever.
+static void LoadJournal (fs::path const &path, fs::path const &dir, unordered_set<string> *done) {
+    ifstream is(path.native());
+    string name;
+    while (getline(is, name)) {
+        if (name.empty()) continue;
+        if (fs::exists(dir / name)) done->insert(name);
+    }
+    fs::path tmp = path.native() + ".tmp";
+    {
+        ofstream os(tmp.native());
+        CHECK(os) << "cannot write " << tmp;
+        for (auto const &n: *done) {
+            os << n << '\n';
+        }
+    }
+    fs::rename(tmp, path);
+}
+
+class Spool {
+    fs::path dir;
+    unsigned settle;
+    unordered_set<string> const &done;
+    unordered_set<string> queued;
+    unordered_set<string> unsettled;    // scanned, maybe still written
+public:
+    struct Item {
+        string name;
+        Clock::time_point arrival;
+    };
+    deque<Item> queue;
+
+    Spool (fs::path const &d, unsigned settle_, unordered_set<string> const &done_)
+        : dir(d), settle(settle_), done(done_) {
+    }
+
+    // closed is set when name is known to be completely written
+    void add (string const &name, bool closed = true) {
+        if (name.empty() || (name[0] == '.')) return;     // temporary files
+        if (done.count(name) || queued.count(name)) return;
+        boost::system::error_code ec;
+        if (!fs::is_regular_file(dir / name, ec)) return;
+        if (!closed) {
+            std::time_t mtime = fs::last_write_time(dir / name, ec);
+            if (ec) return;
+            if (mtime + std::time_t(settle) > std::time(nullptr)) {
+                unsettled.insert(name);
+                return;
+            }
+        }
+        unsettled.erase(name);
+        queued.insert(name);
+        queue.push_back(Item{name, Clock::now()});
+    }
+
+    // picks up files written while we were not watching
+    void scan () {
+        vector<string> names;
+        for (fs::directory_iterator it(dir), end; it != end; ++it) {
+            names.push_back(it->path().filename().native());
+        }
+        sort(names.begin(), names.end());
+        for (auto const &name: names) {
+            add(name, false);
+        }
+    }
+
+    // queues the unsettled files that have not been modified since,
+    // returns the milliseconds until they should be checked again, -1 if none
+    long check () {
+        if (unsettled.empty()) return -1;
+        vector<string> names(unsettled.begin(), unsettled.end());
+        unsettled.clear();
+        sort(names.begin(), names.end());
+        for (auto const &name: names) {
+            add(name, false);
+        }
+        return unsettled.empty() ? -1 : 1000;   // mtime has a resolution of seconds
+    }
+
+    void pop (unsigned n, vector<Item> *items) {
+        items->clear();
+        while (n && !queue.empty()) {
+            items->push_back(queue.front());
+            queued.erase(queue.front().name);
+            queue.pop_front();
+            --n;
+        }
+    }
+};
+
+int main(int argc, char **argv) {
+    namespace po = boost::program_options;
+    string model_dir;
+    fs::path dir;
+    fs::path journal_path;
+    string output_path;
+    unsigned batch;
+    unsigned delay;
+    unsigned settle;
+    string stats_path;
+    double stats_interval;
+
+    po::options_description desc("Allowed options");
+    desc.add_options()
+    ("help,h", "produce help message.")
+    ("model,m", po::value(&model_dir), "")
+    ("dir,d", po::value(&dir), "spool directory")
+    ("batch,b", po::value(&batch)->default_value(32), "")
+    ("delay", po::value(&delay)->default_value(500), "maximal milliseconds a file waits for its batch to fill")
+    ("settle", po::value(&settle)->default_value(2), "seconds a file found by a scan must be unmodified before it is read")
+    ("output,o", po::value(&output_path), "appended to, stdout if not given")
+    ("journal", po::value(&journal_path), "processed files, default to <dir>/.caffex-watch")
+    ("stats", po::value(&stats_path), "periodically rewritten metrics file, in the prometheus text format")
+    ("stats-interval", po::value(&stats_interval)->default_value(10), "seconds between metrics updates")
+    ;
+
+    po::positional_options_description p;
+    p.add("model", 1);
+    p.add("dir", 1);
+
+    po::variables_map vm;
+    po::store(po::command_line_parser(argc, argv).
+                     options(desc).positional(p).run(), vm);
+    po::notify(vm);
+
+    if (vm.count("help") || model_dir.empty() || dir.empty()) {
+        cerr << desc;
+        return 1;
+    }
+    google::InitGoogleLogging(argv[0]);
+    CHECK(fs::is_directory(dir)) << dir << " is not a directory";
+    if (batch < 1) batch = 1;
+    if (journal_path.empty()) journal_path = dir / ".caffex-watch";
+
+    auto &metrics = caffex::Metrics::global();
+    caffex::ImageMetrics m(metrics);
+    auto &latency = metrics.histogram("caffex_latency_seconds", "time from arrival to result");
+    auto &pending = metrics.gauge("caffex_pending_images", "images waiting for a batch");
+    std::unique_ptr<caffex::StatsWriter> stats;
+    if (stats_path.size()) {
+        stats.reset(new caffex::StatsWriter(metrics, stats_path, stats_interval));
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = Stop;   // no SA_RESTART, so poll returns EINTR
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+
+    // the watch is set before scanning, so no file falls in between
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    PCHECK(fd >= 0) << "inotify_init1";
+    PCHECK(inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) >= 0) << "cannot watch " << dir;
+
+    unordered_set<string> done;
+    LoadJournal(journal_path, dir, &done);
+    LOG(INFO) << done.size() << " files already processed";
+    ofstream journal(journal_path.native(), ios::app);
+    CHECK(journal) << "cannot write " << journal_path;
+
+    ofstream output_file;
+    if (output_path.size()) {
+        output_file.open(output_path.c_str(), ios::app);
+        CHECK(output_file) << "cannot write " << output_path;
+    }
+    ostream &output = output_path.size() ? output_file : cout;
+
+    Spool spool(dir, settle, done);
+    spool.scan();
+
+    caffex::CaffexBoost ex(model_dir, batch);
+    vector<Spool::Item> items;
+    vector<cv::Mat> images;
+    vector<unsigned> loaded;
+    cv::Mat pred;
+    char buf[sizeof(struct inotify_event) + NAME_MAX + 1]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+    while (!stop) {
+        // wait for more files unless a batch is due
+        long timeout = spool.check();
+        if (!spool.queue.empty()) {
+            if (spool.queue.size() >= batch) timeout = 0;
+            else {
+                auto due = spool.queue.front().arrival + std::chrono::milliseconds(delay);
+                auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(due - Clock::now()).count();
+                ms = std::max<long>(ms, 0);
+                if ((timeout < 0) || (ms < timeout)) timeout = ms;
+            }
+        }
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        int r = poll(&pfd, 1, int(timeout));
+        if (r < 0) {
+            PCHECK(errno == EINTR) << "poll";
+            continue;
+        }
+        if (r > 0) {
+            for (;;) {
+                ssize_t len = read(fd, buf, sizeof(buf));
+                if (len < 0) {
+                    PCHECK(errno == EAGAIN) << "read inotify";
+                    break;
+                }
+                for (char *ptr = buf; ptr < buf + len; ) {
+                    struct inotify_event const *event = reinterpret_cast<struct inotify_event const *>(ptr);
+                    if (event->mask & IN_Q_OVERFLOW) {
+                        LOG(WARNING) << "inotify queue overflow, rescanning " << dir;
+                        spool.scan();
+                    }
+                    else if (event->len) {
+                        spool.add(event->name);
+                    }
+                    ptr += sizeof(struct inotify_event) + event->len;
+                }
+            }
+        }
+        pending.set(spool.queue.size());
+        if (spool.queue.empty()) continue;
+        if ((spool.queue.size() < batch)
+                && (Clock::now() - spool.queue.front().arrival < std::chrono::milliseconds(delay))) continue;
+
+        spool.pop(batch, &items);
+        images.resize(items.size());
+#pragma omp parallel for schedule(dynamic, 1)
+        for (unsigned i = 0; i < items.size(); ++i) {
+            caffex::Timer timer(m.decode_time);
+            images[i] = cv::imread((dir / items[i].name).native());
+        }
+        // failed files are not journaled, the file may have been read
+        // while still written and is queued again when it is closed
+        loaded.clear();
+        vector<cv::Mat> good;
+        for (unsigned i = 0; i < items.size(); ++i) {
+            if (images[i].total() == 0) {
+                LOG(ERROR) << "failed to load " << items[i].name;
+                m.failures.add();
+                continue;
+            }
+            loaded.push_back(i);
+            good.push_back(images[i]);
+        }
+        if (good.size()) {
+            ex.apply(good, &pred);
+        }
+        {
+            caffex::Timer timer(m.output_time);
+            for (unsigned i = 0; i < loaded.size(); ++i) {
+                output << pred.ptr<float>(i)[0] << '\t' << items[loaded[i]].name << '\n';
+            }
+            output.flush();
+            // journal after the output, so a crash in between scores
+            // files again rather than losing them
+            for (unsigned i: loaded) {
+                journal << items[i].name << '\n';
+                done.insert(items[i].name);
+            }
+            journal.flush();
+        }
+        m.images.add(loaded.size());
+        Clock::time_point now = Clock::now();
+        for (unsigned i: loaded) {
+            latency.observe(std::chrono::duration_cast<std::chrono::microseconds>(now - items[i].arrival).count());
+        }
+        pending.set(spool.queue.size());
+    }
+    LOG(INFO) << "stopped, " << spool.queue.size() << " files left for the next run";
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,133 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <opencv2/opencv.hpp>
+#include <glog/logging.h>
+#include "wordnet.h"
+
+namespace caffex {
+    using std::string;
+    using std::vector;
+
+    // Turns classifier outputs over WordNet synsets, e.g. the ImageNet
+    // leaves, into scores of every synset above them.  The score of a
+    // synset is the sum of the probabilities of the classes at or below
+    // it; since WordNet is a DAG, each class is added once to each of
+    // its ancestors (from the compiled ancestor lists) rather than pushed
+    // up edge by edge, which would count classes with several paths
+    // more than once.
+    // Scores are kept as synsets x images, so each update is one add of
+    // a contiguous row over the whole batch.  Buffers are reused across
+    // batches; use one scorer per thread.
+    class WordNetScorer {
+    public:
+        struct Prediction {
+            unsigned synset;
+            float score;
+        };
+
+        // wnids: synset of each output column of the classifier
+        WordNetScorer (WordNetIndex const &wn_, vector<string> const &wnids): wn(wn_), row_of(wn_.size(), -1) {
+            vector<unsigned> classes;
+            for (auto const &w: wnids) {
+                int s = wn.find(w);
+                CHECK(s >= 0) << "unknown wnid " << w;
+                classes.push_back(s);
+                row_of[s] = 0;
+                for (unsigned a: wn.ancestors(s)) {
+                    row_of[a] = 0;
+                }
+            }
+            // only synsets above some class get a row
+            for (unsigned s = 0; s < row_of.size(); ++s) {
+                if (row_of[s] < 0) continue;
+                row_of[s] = synsets.size();
+                synsets.push_back(s);
+            }
+            target_off.push_back(0);
+            for (unsigned s: classes) {
+                targets.push_back(row_of[s]);
+                for (unsigned a: wn.ancestors(s)) {
+                    targets.push_back(row_of[a]);
+                }
+                target_off.push_back(targets.size());
+            }
+        }
+
+        unsigned classes () const {
+            return target_off.size() - 1;
+        }
+
+        // probs: images x classes, CV_32FC1, as from
+        // Caffex::apply(vector<cv::Mat> const &, cv::Mat *)
+        void apply (cv::Mat const &probs) {
+            CHECK(probs.type() == CV_32FC1);
+            CHECK(probs.cols == int(classes())) << "expect " << classes() << " classes";
+            cv::transpose(probs, columns);
+            int n = probs.rows;
+            scores.create(synsets.size(), n, CV_32FC1);
+            scores.setTo(cv::Scalar(0));
+            for (unsigned c = 0; c < classes(); ++c) {
+                float const *from = columns.ptr<float>(c);
+                for (unsigned t = target_off[c]; t < target_off[c + 1]; ++t) {
+                    float *to = scores.ptr<float>(targets[t]);
+                    for (int i = 0; i < n; ++i) {
+                        to[i] += from[i];
+                    }
+                }
+            }
+        }
+
+        unsigned images () const {
+            return scores.cols;
+        }
+
+        // score of a synset for an image of the last batch
+        float score (unsigned image, unsigned synset) const {
+            int r = row_of[synset];
+            if (r < 0) return 0;
+            return scores.ptr<float>(r)[image];
+        }
+
+        // The k highest scoring synsets with score >= th, leaving out
+        // those with a descendant also >= th: a score includes the
+        // scores of the descendants, so it would only restate them.
+        void topk (unsigned image, unsigned k, float th, vector<Prediction> *out) {
+            out->clear();
+            covered.assign(synsets.size(), 0);
+            for (unsigned r = 0; r < synsets.size(); ++r) {
+                if (scores.ptr<float>(r)[image] < th) continue;
+                for (unsigned a: wn.ancestors(synsets[r])) {
+                    covered[row_of[a]] = 1;
+                }
+            }
+            candidates.clear();
+            for (unsigned r = 0; r < synsets.size(); ++r) {
+                float s = scores.ptr<float>(r)[image];
+                if ((s < th) || covered[r]) continue;
+                Prediction p;
+                p.synset = synsets[r];
+                p.score = s;
+                candidates.push_back(p);
+            }
+            std::sort(candidates.begin(), candidates.end(), [](Prediction const &a, Prediction const &b) {
+                if (a.score != b.score) return a.score > b.score;
+                return a.synset < b.synset;
+            });
+            if (candidates.size() > k) candidates.resize(k);
+            out->assign(candidates.begin(), candidates.end());
+        }
+
+    private:
+        WordNetIndex const &wn;
+        vector<int> row_of;             // synset -> row of scores, -1 if no class below
+        vector<unsigned> synsets;       // row -> synset
+        vector<unsigned> target_off;    // class -> rows it adds to, CSR
+        vector<unsigned> targets;
+        cv::Mat columns;                // classes x images
+        cv::Mat scores;                 // synsets x images
+        vector<Prediction> candidates;
+        vector<char> covered;           // row -> has a descendant >= th
+    };
+}
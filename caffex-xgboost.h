@@ -0,0 +1,58 @@
+#pragma once
+#include <fstream>
+#include <memory>
+#include "caffex.h"
+#include "trees.h"
+
+namespace caffex {
+
+// Caffex features scored by a tree ensemble.
+// In addition to the files needed by Caffex, the model directory contains
+//  - xgboost.dump: text dump of the xgboost model trained on the
+//    libsvm output of caffex-extract
+//  - xgboost.conf (optional): "objective binary:logistic|reg:linear",
+//    "base_score 0.5" and "feature_base 1", one per line
+class CaffexBoost: public Caffex {
+    std::unique_ptr<TreeEnsemble> trees;
+    cv::Mat features;
+
+    static TreeEnsemble *load (string const &model_dir) {
+        int objective = TreeEnsemble::LOGISTIC;
+        float base_score = 0.5;
+        unsigned feature_base = 1;
+        std::ifstream is((model_dir + "/xgboost.conf").c_str());
+        string key, value;
+        while (is >> key >> value) {
+            if (key == "objective") {
+                if (value == "binary:logistic") objective = TreeEnsemble::LOGISTIC;
+                else if ((value == "reg:linear") || (value == "binary:logitraw")) objective = TreeEnsemble::LINEAR;
+                else LOG(FATAL) << "unsupported objective " << value;
+            }
+            else if (key == "base_score") base_score = std::stof(value);
+            else if (key == "feature_base") feature_base = std::stoi(value);
+            else LOG(WARNING) << "unknown xgboost.conf key " << key;
+        }
+        return new TreeEnsemble(model_dir + "/xgboost.dump", objective, base_score, feature_base);
+    }
+public:
+    CaffexBoost (string const &model_dir, unsigned batch = 1)
+        : Caffex(model_dir, batch), trees(load(model_dir)) {
+    }
+    void apply (cv::Mat const &image, vector<float> *pred) {
+        vector<float> ft;
+        Caffex::apply(image, &ft);
+        CHECK(ft.size() >= trees->features()) << "model uses more features than the network outputs";
+        pred->resize(1);
+        trees->predict(&ft[0], ft.size(), 1, &pred->at(0));
+    }
+    // one prediction per image, *pred is images x 1
+    void apply (vector<cv::Mat> const &images, cv::Mat *pred) {
+        // rows are scored in place in the feature buffer
+        Caffex::apply(images, &features);
+        CHECK(unsigned(features.cols) >= trees->features()) << "model uses more features than the network outputs";
+        pred->create(features.rows, 1, CV_32FC1);
+        trees->predict(features.ptr<float>(0), features.cols, features.rows, pred->ptr<float>(0));
+    }
+};
+
+}
@@ -2,8 +2,13 @@
 #include <iostream>
 #include <fstream>
 #include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <boost/filesystem.hpp>
+#include <caffe/util/io.hpp>
 #define CAFFEX_IMPL 1
 #include "caffex.h"
+#include "metrics.h"
 
 namespace caffex {
 
@@ -31,8 +36,13 @@ Caffex::Caffex(string const& model_dir, unsigned batch)
     // resize to required batch size
     int input_h = input_blob->shape(2);
     int input_w = input_blob->shape(3);
-    fix_shape = ((input_h > 1) && (input_w > 1));
-    if (!fix_shape) {
+    dense = std::ifstream((model_dir + "/caffe.dense").c_str()).good();
+    fix_shape = ((input_h > 1) && (input_w > 1)) && !dense;
+    if (dense) {
+        // input size in caffe.model is the smallest the net accepts
+        min_size = cv::Size(input_w, input_h);
+    }
+    else if (!fix_shape) {
         BOOST_VERIFY(input_h == 1);
         BOOST_VERIFY(input_w == 1);
         input_h = fcn_test_sz.height;
@@ -130,7 +140,7 @@ void Caffex::wrapInputLayer (std::vector<cv::Mat>* channels) {
     int input_height = input_blob->shape(2);
     int input_width = input_blob->shape(3);
     float *input_data = input_blob->mutable_cpu_data();
-    for (int i = 0; i < input_batch; ++i) {
+    for (int i = 0; i < input_blob->shape(0); ++i) {
         for (int j = 0; j < input_channels; ++j) {
             cv::Mat m(input_height, input_width, CV_32FC1, input_data);
             channels->push_back(m);
@@ -212,20 +222,57 @@ void Caffex::extractOutputValues (float *ptr, int output_dim, int n) {
     } 
 }
 
-void Caffex::checkReshape (cv::Mat const &image) {
-    if (!fix_shape) {
+void Caffex::checkReshape (cv::Mat const &image, int batch) {
+    if (fix_shape) {
+        if (input_blob->shape(0) != batch) {
+            input_blob->Reshape(batch, input_channels, input_blob->shape(2), input_blob->shape(3));
+            net.Reshape();
+        }
+    }
+    else {
         int rows = image.rows;
         int cols = image.cols;
+        if (dense) {
+            CHECK((cols >= min_size.width) && (rows >= min_size.height))
+                << "image " << cols << 'x' << rows << " is smaller than the model input "
+                << min_size.width << 'x' << min_size.height;
+        }
         int input_height = input_blob->shape(2);
         int input_width = input_blob->shape(3);
         if ((input_width != cols)
-                || (input_height != rows)) {
-            input_blob->Reshape(input_batch, input_channels, rows, cols);
+                || (input_height != rows)
+                || (input_blob->shape(0) != batch)) {
+            input_blob->Reshape(batch, input_channels, rows, cols);
             net.Reshape();
         }
     }
 }
 
+cv::Size Caffex::output_size () const {
+    auto const &b = output_blobs[0];
+    if (b->num_axes() < 4) return cv::Size(1, 1);
+    return cv::Size(b->shape(3), b->shape(2));
+}
+
+size_t Caffex::memory () const {
+    // a blob keeps its memory when reshaped smaller, and blobs may
+    // share memory, e.g. through Flatten, so count each allocation once
+    std::unordered_set<SyncedMemory const *> seen;
+    size_t v = 0;
+    auto add = [&](Blob<float> const &b) {
+        if (b.count() == 0) return;     // data() checks the memory exists
+        SyncedMemory const *m = b.data().get();
+        if (seen.insert(m).second) v += m->size();
+    };
+    for (auto const &b: net.blobs()) {
+        add(*b);
+    }
+    for (auto const &p: net.params()) {
+        add(*p);
+    }
+    return v;
+}
+
 int Caffex::dim () const {
     int v = 0;
     for (auto const &b: output_blobs) {
@@ -234,43 +281,390 @@ int Caffex::dim () const {
     return v;
 }
 
+void Caffex::forward (vector<cv::Mat> const &images, int batch) {
+    CHECK(!images.empty()) << "must input >= 1 images";
+    CHECK(images.size() <= batch) << "Too many input images.";
+    if (!fix_shape) {
+        for (unsigned i = 1; i < images.size(); ++i) {
+            CHECK(images[i].size() == images[0].size()) << "all images must be the same size";
+        }
+    }
+    static Histogram &preprocess_time = Metrics::global().histogram("caffex_preprocess_seconds", "time to fill the input blob of a batch");
+    static Histogram &forward_time = Metrics::global().histogram("caffex_forward_seconds", "time of a forward pass");
+    static Counter &forwarded = Metrics::global().counter("caffex_forward_images_total", "images through the network");
+    {
+        Timer timer(preprocess_time);
+        checkReshape(images[0], batch);
+        vector<cv::Mat> channels;
+        wrapInputLayer(&channels);
+        preprocess(images, &channels);
+        CHECK(reinterpret_cast<float*>(channels[0].data) == net.input_blobs()[0]->cpu_data())
+            << "Input channels are not wrapping the input layer of the network.";
+    }
+    {
+        Timer timer(forward_time);
+        net.ForwardPrefilled();
+    }
+    forwarded.add(images.size());
+}
+
 void Caffex::apply (const cv::Mat &image, vector<float> *ft) {
-    checkReshape(image);
+    forward(vector<cv::Mat>{image}, input_batch);
     int output_dim = dim(); // output dim changed after reshape
-
-    vector<cv::Mat> channels;
-    wrapInputLayer(&channels);
-    preprocess(image, &channels);
-    CHECK(reinterpret_cast<float*>(channels[0].data) == net.input_blobs()[0]->cpu_data())
-        << "Input channels are not wrapping the input layer of the network.";
-    net.ForwardPrefilled();
     ft->resize(output_dim);
     extractOutputValues(&ft->at(0), output_dim, 1);
 }
 
 
 void Caffex::apply(vector<cv::Mat> const &images, cv::Mat *ft) {
-    CHECK(!images.empty()) << "must input >= 1 images";
-    CHECK(images.size() <= input_batch) << "Too many input images.";
-    if (!fix_shape) {
-        for (unsigned i = 1; i < images.size(); ++i) {
-            CHECK(images[i].size() == images[0].size()) << "all images must be the same size";
-        }
-    }
-    checkReshape(images[0]);
+    forward(images, input_batch);
     int output_dim = dim(); // output dim changed after reshape
-
-    vector<cv::Mat> channels;
-    wrapInputLayer(&channels);
-    preprocess(images, &channels);
-    CHECK(reinterpret_cast<float*>(channels[0].data) == net.input_blobs()[0]->cpu_data())
-        << "Input channels are not wrapping the input layer of the network.";
-    net.ForwardPrefilled();
     ft->create(images.size(), output_dim, CV_32FC1);
     extractOutputValues(ft->ptr<float>(0), output_dim, images.size());
 }
 
+// to += from, mirrored horizontally if flip
+static void Accumulate (cv::Mat const &from, bool flip, float *to) {
+    int cols = from.cols;
+    for (int y = 0; y < from.rows; ++y) {
+        float const *f = from.ptr<float>(y);
+        float *t = to + y * cols;
+        if (flip) {
+            for (int x = 0; x < cols; ++x) {
+                t[cols - 1 - x] += f[x];
+            }
+        }
+        else {
+            for (int x = 0; x < cols; ++x) {
+                t[x] += f[x];
+            }
+        }
+    }
+}
 
+void Caffex::apply_tta (cv::Mat const &image, vector<float> const &scales, bool flip, vector<float> *ft) {
+    CHECK(fcn) << "test-time augmentation needs an FCN model";
+    CHECK(output_blobs.size() == 1);
+    CHECK(!scales.empty());
+    auto const &blob = output_blobs[0];
+    int variants = 0;
+    vector<cv::Mat> batch;
+    cv::Mat resized, flipped, up;
+    for (float scale: scales) {
+        // the plain and flipped image share one forward pass
+        if (scale == 1) {
+            resized = image;
+        }
+        else {
+            cv::resize(image, resized, cv::Size(), scale, scale, scale < 1 ? cv::INTER_AREA : cv::INTER_LINEAR);
+        }
+        batch.clear();
+        batch.push_back(resized);
+        if (flip) {
+            cv::flip(resized, flipped, 1);
+            batch.push_back(flipped);
+        }
+        forward(batch, batch.size());
+        if (variants == 0) {
+            ft->assign(blob->shape(1) * image.rows * image.cols, 0);
+        }
+        // undo scale and flip of each output channel, add to ft
+        for (unsigned i = 0; i < batch.size(); ++i) {
+            for (int ch = 0; ch < blob->shape(1); ++ch) {
+                cv::Mat out(blob->shape(2), blob->shape(3), CV_32FC1,
+                            const_cast<float *>(blob->cpu_data() + blob->offset(i, ch)));
+                if (out.size() != image.size()) {
+                    cv::resize(out, up, image.size());
+                    out = up;
+                }
+                Accumulate(out, i == 1, &ft->at(ch * image.total()));
+            }
+            ++variants;
+        }
+    }
+    float r = 1.0 / variants;
+    for (auto &v: *ft) {
+        v *= r;
+    }
 }
 
 
+void Caffex::apply_cascade (cv::Mat const &image, Cascade const &cascade, vector<float> *ft) {
+    CHECK(fcn) << "cascade needs an FCN model";
+    CHECK(output_blobs.size() == 1);
+    CHECK(cascade.tile > 0 && cascade.margin >= 0);
+    int win = cascade.tile + 2 * cascade.margin;
+    if ((cascade.scale >= 1) || (image.cols <= win) || (image.rows <= win)) {
+        apply(image, ft);
+        return;
+    }
+    auto const &blob = output_blobs[0];
+    size_t area = image.total();
+    // coarse pass, upsampled straight into ft
+    cv::Mat small;
+    cv::resize(image, small, cv::Size(), cascade.scale, cascade.scale, cv::INTER_AREA);
+    forward(vector<cv::Mat>{small}, 1);
+    int C = blob->shape(1);
+    CHECK(cascade.channel < C);
+    ft->resize(C * area);
+    for (int ch = 0; ch < C; ++ch) {
+        cv::Mat out(blob->shape(2), blob->shape(3), CV_32FC1,
+                    const_cast<float *>(blob->cpu_data() + blob->offset(0, ch)));
+        cv::Mat to(image.size(), CV_32FC1, &ft->at(ch * area));
+        cv::resize(out, to, image.size(), 0, 0, cv::INTER_LINEAR);
+    }
+    // ambiguous tiles, the coarse output is kept where the tested
+    // channel is clearly below th or above th_high everywhere
+    vector<cv::Rect> tiles, windows;
+    cv::Mat plane(image.size(), CV_32FC1, &ft->at(cascade.channel * area));
+    for (int y = 0; y < image.rows; y += cascade.tile) {
+        for (int x = 0; x < image.cols; x += cascade.tile) {
+            cv::Rect tile(x, y, std::min(cascade.tile, image.cols - x), std::min(cascade.tile, image.rows - y));
+            bool hit = false;
+            for (int yy = tile.y; (yy < tile.y + tile.height) && !hit; ++yy) {
+                float const *p = plane.ptr<float>(yy);
+                for (int xx = tile.x; xx < tile.x + tile.width; ++xx) {
+                    float v = cascade.invert ? 1 - p[xx] : p[xx];
+                    if ((v >= cascade.th) && (v <= cascade.th_high)) {
+                        hit = true;
+                        break;
+                    }
+                }
+            }
+            if (!hit) continue;
+            // window of tile plus margin, shifted to stay inside the image
+            int wx = std::min(std::max(0, x - cascade.margin), image.cols - win);
+            int wy = std::min(std::max(0, y - cascade.margin), image.rows - win);
+            tiles.push_back(tile);
+            windows.push_back(cv::Rect(wx, wy, win, win));
+        }
+    }
+    // fine passes, windows are all the same size so they share batches
+    int batch = (cascade.batch > 0) ? cascade.batch : input_batch;
+    vector<cv::Mat> inputs;
+    for (unsigned begin = 0; begin < windows.size(); begin += batch) {
+        unsigned end = std::min<unsigned>(begin + batch, windows.size());
+        inputs.clear();
+        for (unsigned i = begin; i < end; ++i) {
+            inputs.push_back(image(windows[i]));
+        }
+        forward(inputs, inputs.size());
+        // outputs of strided models are smaller than the window
+        int oh = blob->shape(2), ow = blob->shape(3);
+        cv::Mat up;
+        for (unsigned i = begin; i < end; ++i) {
+            cv::Rect const &t = tiles[i];
+            cv::Rect const &w = windows[i];
+            for (int ch = 0; ch < C; ++ch) {
+                cv::Mat out(oh, ow, CV_32FC1,
+                            const_cast<float *>(blob->cpu_data() + blob->offset(i - begin, ch)));
+                if ((oh == win) && (ow == win)) {
+                    up = out;
+                }
+                else {
+                    cv::resize(out, up, cv::Size(win, win), 0, 0, cv::INTER_LINEAR);
+                }
+                float *to = &ft->at(ch * area);
+                for (int y = t.y; y < t.y + t.height; ++y) {
+                    float const *f = up.ptr<float>(y - w.y) + (t.x - w.x);
+                    std::copy(f, f + t.width, to + size_t(y) * image.cols + t.x);
+                }
+            }
+        }
+    }
+}
+
+void Caffex::apply_rois (cv::Mat const &image, vector<cv::Rect> const &rois, int mode, cv::Size shape, vector<vector<float>> *outputs) {
+    CHECK(output_blobs.size() == 1);
+    CHECK((mode == ROI_RESIZE) || (mode == ROI_PAD));
+    auto const &blob = output_blobs[0];
+    cv::Rect bounds(0, 0, image.cols, image.rows);
+    vector<cv::Rect> boxes;
+    for (auto const &roi: rois) {
+        boxes.push_back(roi & bounds);
+    }
+    outputs->clear();
+    outputs->resize(boxes.size());
+    if (boxes.empty()) return;
+    if (fix_shape) {
+        // preprocess resizes to the input size anyway
+        shape = cv::Size(input_blob->shape(3), input_blob->shape(2));
+        mode = ROI_RESIZE;
+    }
+    else if (shape.area() == 0) {
+        for (auto const &b: boxes) {
+            shape.width = std::max(shape.width, b.width);
+            shape.height = std::max(shape.height, b.height);
+        }
+    }
+    cv::Scalar pad(means[0], means.size() > 1 ? means[1] : 0, means.size() > 2 ? means[2] : 0);
+    vector<cv::Mat> inputs;
+    vector<cv::Rect> placed;    // where each crop went in the shared shape
+    for (unsigned begin = 0; begin < boxes.size(); begin += input_batch) {
+        unsigned end = std::min<unsigned>(begin + input_batch, boxes.size());
+        inputs.clear();
+        placed.clear();
+        for (unsigned i = begin; i < end; ++i) {
+            cv::Mat crop = image(boxes[i]);     // a view, nothing is copied
+            cv::Rect at(0, 0, shape.width, shape.height);
+            if (boxes[i].area() == 0) {
+                inputs.push_back(cv::Mat(shape, image.type(), pad));
+            }
+            else if (mode == ROI_RESIZE) {
+                cv::Mat m;
+                if (crop.size() == shape) m = crop;
+                else cv::resize(crop, m, shape);
+                inputs.push_back(m);
+            }
+            else {
+                // keep the aspect ratio, shrink only if the crop does not fit
+                float s = std::min(1.0f, std::min(1.0f * shape.width / crop.cols, 1.0f * shape.height / crop.rows));
+                at.width = std::max(1, int(crop.cols * s));
+                at.height = std::max(1, int(crop.rows * s));
+                cv::Mat canvas(shape, image.type(), pad);
+                cv::Mat dst = canvas(at);
+                if (at.size() == crop.size()) crop.copyTo(dst);
+                else cv::resize(crop, dst, at.size());
+                inputs.push_back(canvas);
+            }
+            placed.push_back(at);
+        }
+        forward(inputs, inputs.size());
+        int item = blob->count() / blob->shape(0);
+        for (unsigned i = begin; i < end; ++i) {
+            float const *out = blob->cpu_data() + blob->offset(i - begin);
+            vector<float> &ft = outputs->at(i);
+            if (!fcn) {
+                ft.assign(out, out + item);
+                continue;
+            }
+            // map the output back to the box
+            cv::Rect const &b = boxes[i];
+            cv::Rect const &at = placed[i - begin];
+            int C = blob->shape(1);
+            int oh = blob->shape(2), ow = blob->shape(3);
+            ft.resize(C * b.area());
+            if (b.area() == 0) continue;
+            // at is in input coordinates, the output may be strided
+            cv::Rect o(at.x * ow / shape.width, at.y * oh / shape.height,
+                       std::max(1, at.width * ow / shape.width),
+                       std::max(1, at.height * oh / shape.height));
+            o &= cv::Rect(0, 0, ow, oh);
+            for (int ch = 0; ch < C; ++ch) {
+                cv::Mat plane(oh, ow, CV_32FC1, const_cast<float *>(out + ch * oh * ow));
+                cv::Mat to(b.size(), CV_32FC1, &ft[ch * b.area()]);
+                cv::Mat from = plane(o);
+                if (from.size() == b.size()) from.copyTo(to);
+                else cv::resize(from, to, b.size());
+            }
+        }
+    }
+}
+
+void Caffex::convolutionize (string const &model_dir, string const &out_dir) {
+    namespace fs = boost::filesystem;
+    // blob shapes come from the original net at its input size
+    Net<float> net(model_dir + "/caffe.model", TEST);
+    NetParameter model;
+    ReadProtoFromTextFileOrDie(model_dir + "/caffe.model", &model);
+    CHECK(model.layers_size() == 0) << "V1 layers are not supported, upgrade the model first";
+
+    struct Kernel {
+        int num_output, channels, height, width;
+    };
+    std::unordered_map<string, Kernel> kernels;         // converted layers
+    std::unordered_map<string, string> renames;         // Flatten top -> bottom
+    auto rename = [&renames](string const &name) {
+        auto it = renames.find(name);
+        return (it == renames.end()) ? name : it->second;
+    };
+    NetParameter converted(model);
+    converted.clear_layer();
+    for (int i = 0; i < model.layer_size(); ++i) {
+        LayerParameter layer = model.layer(i);
+        for (int j = 0; j < layer.bottom_size(); ++j) {
+            // in-place layers on a dropped blob follow it too
+            for (int k = 0; k < layer.top_size(); ++k) {
+                if (layer.top(k) == layer.bottom(j)) layer.set_top(k, rename(layer.top(k)));
+            }
+            layer.set_bottom(j, rename(layer.bottom(j)));
+        }
+        if (layer.type() == "Flatten") {
+            CHECK(layer.bottom_size() == 1 && layer.top_size() == 1);
+            renames[layer.top(0)] = layer.bottom(0);
+            continue;
+        }
+        if (layer.type() == "InnerProduct") {
+            InnerProductParameter const ip = layer.inner_product_param();
+            CHECK(ip.axis() == 1) << layer.name() << ": only axis 1 is supported";
+            CHECK(!ip.transpose()) << layer.name() << ": transposed weights are not supported";
+            CHECK(layer.bottom_size() == 1);
+            // the kernel covers the whole input of the layer
+            shared_ptr<Blob<float>> bottom = net.blob_by_name(layer.bottom(0));
+            Kernel k;
+            k.num_output = ip.num_output();
+            if (bottom->num_axes() == 4) {
+                k.channels = bottom->shape(1);
+                k.height = bottom->shape(2);
+                k.width = bottom->shape(3);
+            }
+            else {
+                k.channels = bottom->count(1);
+                k.height = k.width = 1;
+            }
+            kernels[layer.name()] = k;
+            layer.set_type("Convolution");
+            ConvolutionParameter *conv = layer.mutable_convolution_param();
+            conv->set_num_output(k.num_output);
+            conv->set_bias_term(ip.bias_term());
+            conv->set_kernel_h(k.height);
+            conv->set_kernel_w(k.width);
+            if (ip.has_weight_filler()) *conv->mutable_weight_filler() = ip.weight_filler();
+            if (ip.has_bias_filler()) *conv->mutable_bias_filler() = ip.bias_filler();
+            layer.clear_inner_product_param();
+            LOG(INFO) << layer.name() << ": InnerProduct -> Convolution " << k.num_output
+                      << 'x' << k.channels << 'x' << k.height << 'x' << k.width;
+        }
+        *converted.add_layer() = layer;
+    }
+    CHECK(kernels.size()) << "no InnerProduct layer in " << model_dir;
+
+    // trained parameters: same data, conv shaped blobs
+    NetParameter params;
+    ReadProtoFromBinaryFileOrDie(model_dir + "/caffe.params", &params);
+    CHECK(params.layers_size() == 0) << "V1 layers are not supported, upgrade the model first";
+    for (int i = 0; i < params.layer_size(); ++i) {
+        LayerParameter *layer = params.mutable_layer(i);
+        auto it = kernels.find(layer->name());
+        if (it == kernels.end()) continue;
+        Kernel const &k = it->second;
+        layer->set_type("Convolution");
+        CHECK(layer->blobs_size() >= 1);
+        BlobProto *w = layer->mutable_blobs(0);
+        CHECK(w->data_size() == k.num_output * k.channels * k.height * k.width)
+            << layer->name() << ": weights do not match the net";
+        w->clear_num();
+        w->clear_channels();
+        w->clear_height();
+        w->clear_width();
+        BlobShape *shape = w->mutable_shape();
+        shape->clear_dim();
+        shape->add_dim(k.num_output);
+        shape->add_dim(k.channels);
+        shape->add_dim(k.height);
+        shape->add_dim(k.width);
+    }
+
+    fs::create_directories(out_dir);
+    WriteProtoToTextFile(converted, out_dir + "/caffe.model");
+    WriteProtoToBinaryFile(params, out_dir + "/caffe.params");
+    for (char const *name: {"caffe.mean", "blobs", "extra"}) {
+        fs::path from = fs::path(model_dir) / name;
+        if (fs::exists(from)) {
+            fs::copy_file(from, fs::path(out_dir) / name, fs::copy_option::overwrite_if_exists);
+        }
+    }
+    std::ofstream((out_dir + "/caffe.dense").c_str()) << "1" << std::endl;
+}
+
+}
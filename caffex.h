@@ -16,8 +16,13 @@ using boost::shared_ptr;
 //  - caffe.model: network model
 //  - caffe.params: trained parameters
 //  - caffe.mean: mean image
+//  - caffe.dense (optional): marks a classifier converted by
+//    convolutionize, which runs on images of any size not smaller than
+//    the input size in caffe.model
 class Caffex {
     bool fix_shape;
+    bool dense;
+    cv::Size min_size;  // dense models only
     Net<float> net;
     int input_batch;
     int input_channels;
@@ -39,7 +44,9 @@ class Caffex {
             off += input_channels;
         }
     }
-    void checkReshape (cv::Mat const &image);   // reshape network to image size
+    void checkReshape (cv::Mat const &image, int batch);   // reshape network to batch x image size
+    // fill the input blob with images and run the network
+    void forward (vector<cv::Mat> const &images, int batch);
     int dim () const;
     bool fcn;
 public:
@@ -50,11 +57,71 @@ public:
     bool is_fcn () const {
         return fcn;
     }
+    bool is_dense () const {
+        return dense;
+    }
+    // spatial size of the first output blob after the last apply,
+    // 1x1 for non-spatial outputs
+    cv::Size output_size () const;
     string const &extra () const {
         return _extra;
     }
+    // bytes allocated for weights and activations, activations are
+    // as large as for the largest input shape so far
+    size_t memory () const;
     void apply (cv::Mat const &, vector<float> *);
     void apply (vector<cv::Mat> const &, cv::Mat *);    // might not work, haven't been tested
+    // Runs images without copying the outputs out of the network; read
+    // the first images.size() rows of outputs() before the next apply.
+    void apply (vector<cv::Mat> const &images) {
+        forward(images, input_batch);
+    }
+    vector<shared_ptr<Blob<float>>> const &outputs () const {
+        return output_blobs;
+    }
+    // Test-time augmentation for FCN models: the image is run at each
+    // scale, together with its mirror if flip is set (one forward pass
+    // per scale), and the outputs are resized back to the image and
+    // averaged into ft, laid out as channels x image rows x image cols
+    // (not at the output resolution given by output_size()).
+    void apply_tta (cv::Mat const &image, vector<float> const &scales, bool flip, vector<float> *ft);
+
+    struct Cascade {
+        float scale;    // of the coarse pass
+        int tile;       // refined tile size
+        int margin;     // context around each refined tile
+        int channel;    // output channel tested for refinement
+        float th;       // refine tiles where the channel is ambiguous,
+        float th_high;  // i.e. within [th, th_high] somewhere
+        bool invert;    // test 1 - value instead, e.g. for background probabilities
+        int batch;      // tiles per forward pass, 0 for the Caffex batch
+        Cascade (): scale(0.25), tile(256), margin(32), channel(0), th(0.1), th_high(0.9), invert(false), batch(0) {
+        }
+    };
+    // Coarse-to-fine inference for FCN models: the image is run at a
+    // lower scale, then the tiles where the upsampled output reaches th
+    // are run again at full resolution (with some context, in batches)
+    // and replace the coarse output.  ft is laid out as by apply.
+    void apply_cascade (cv::Mat const &image, Cascade const &cascade, vector<float> *ft);
+
+    enum {
+        ROI_RESIZE = 0,     // stretch each crop to the shared shape
+        ROI_PAD = 1         // place each crop at the top-left, pad with the mean
+    };
+    // Runs the regions rois of image (clipped to the image) as batches
+    // of one shared shape, by default the largest region.  Crops are
+    // views into image; only the resized or padded inputs are built.
+    // For FCN models (*outputs)[i] is the output mapped back to
+    // rois[i], laid out as by apply at the region size; for other
+    // models it is the raw output of the region.
+    void apply_rois (cv::Mat const &image, vector<cv::Rect> const &rois, int mode, cv::Size shape, vector<vector<float>> *outputs);
+
+    // Rewrites a classifier so it can scan whole images in one pass:
+    // every InnerProduct layer becomes a Convolution whose kernel covers
+    // its whole input, with the trained weights reshaped (the memory
+    // layout is the same), and Flatten layers are dropped.  The result
+    // is written to out_dir with the other model files and caffe.dense.
+    static void convolutionize (string const &model_dir, string const &out_dir);
 };
 
 
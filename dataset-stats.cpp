@@ -0,0 +1,259 @@
+#define CPU_ONLY 1
+#include <string>
+#include <utility>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <cmath>
+#include <fstream>
+#include <boost/scoped_ptr.hpp>
+#include <boost/program_options.hpp>
+
+#include <glog/logging.h>
+
+#include <caffe/proto/caffe.pb.h>
+#include <caffe/util/db.hpp>
+#include "shard.h"
+
+using namespace std;
+using namespace boost;
+using namespace caffe;  // NOLINT(build/namespaces)
+
+string backend("lmdb");
+int size_bin = 32;          // pixels, for the max side histogram
+float aspect_bin = 0.25;    // log2(width/height) bin width
+
+// Statistics accumulated over a set of images.
+// Each thread keeps its own copy; copies are merged at the end.
+struct Stats {
+    size_t images;
+    size_t pixels;
+    vector<double> sum;     // per channel
+    vector<double> sum2;
+    vector<size_t> classes; // label pixel counts
+    unordered_map<uint64_t, size_t> shapes;     // (height << 32) | width
+    unordered_map<int, size_t> sides;           // max side bins
+    unordered_map<int, size_t> aspects;         // log aspect bins
+
+    Stats (): images(0), pixels(0), sum(3, 0), sum2(3, 0), classes(256, 0) {
+    }
+
+    void addImage (Datum const &datum) {
+        CHECK(!datum.encoded()) << "encoded datum is not supported";
+        int c = datum.channels();
+        int h = datum.height();
+        int w = datum.width();
+        CHECK((c == 1) || (c == 3));
+        size_t sz = size_t(h) * w;
+        uint8_t const *data = reinterpret_cast<uint8_t const *>(datum.data().data());
+        for (int ch = 0; ch < c; ++ch) {
+            // integer sums are exact and vectorize well
+            uint64_t s = 0, s2 = 0;
+            uint8_t const *plane = data + ch * sz;
+            for (size_t i = 0; i < sz; ++i) {
+                uint32_t v = plane[i];
+                s += v;
+                s2 += v * v;
+            }
+            // gray images count towards all channels
+            for (int to = ch; to < 3; to += c) {
+                sum[to] += s;
+                sum2[to] += s2;
+            }
+        }
+        ++images;
+        pixels += sz;
+        ++shapes[(uint64_t(h) << 32) | w];
+        ++sides[std::max(h, w) / size_bin];
+        if ((h > 0) && (w > 0)) {   // empty images have no aspect ratio
+            ++aspects[int(std::floor(std::log2(1.0 * w / h) / aspect_bin))];
+        }
+    }
+
+    void addLabel (Datum const &datum) {
+        size_t sz = size_t(datum.height()) * datum.width() * datum.channels();
+        uint8_t const *data = reinterpret_cast<uint8_t const *>(datum.data().data());
+        size_t local[256] = {0};
+        for (size_t i = 0; i < sz; ++i) {
+            ++local[data[i]];
+        }
+        for (unsigned i = 0; i < 256; ++i) {
+            classes[i] += local[i];
+        }
+    }
+
+    void merge (Stats const &s) {
+        images += s.images;
+        pixels += s.pixels;
+        for (unsigned i = 0; i < sum.size(); ++i) {
+            sum[i] += s.sum[i];
+            sum2[i] += s.sum2[i];
+        }
+        for (unsigned i = 0; i < classes.size(); ++i) {
+            classes[i] += s.classes[i];
+        }
+        for (auto const &p: s.shapes) shapes[p.first] += p.second;
+        for (auto const &p: s.sides) sides[p.first] += p.second;
+        for (auto const &p: s.aspects) aspects[p.first] += p.second;
+    }
+};
+
+template <typename K>
+static vector<pair<K, size_t>> sorted (unordered_map<K, size_t> const &m) {
+    vector<pair<K, size_t>> v(m.begin(), m.end());
+    sort(v.begin(), v.end());
+    return v;
+}
+
+int main(int argc, char **argv) {
+    namespace po = boost::program_options;
+    string image_db_dir;
+    string label_db_dir;
+    string mean_path;
+    unsigned batch;
+    unsigned top;
+    size_t max_records;
+
+    po::options_description desc("Allowed options");
+    desc.add_options()
+    ("help,h", "produce help message.")
+    ("image", po::value(&image_db_dir), "")
+    ("label", po::value(&label_db_dir), "")
+    ("mean", po::value(&mean_path), "write per-channel means in caffe.mean format")
+    ("backend", po::value(&backend)->default_value(backend), "lmdb, leveldb or shard")
+    ("batch", po::value(&batch)->default_value(256), "records handed to the threads at a time")
+    ("top", po::value(&top)->default_value(10), "number of most frequent image shapes to list")
+    ("size-bin", po::value(&size_bin)->default_value(size_bin), "")
+    ("aspect-bin", po::value(&aspect_bin)->default_value(aspect_bin), "")
+    (",M", po::value(&max_records)->default_value(0), "stop after this many records, 0 for all")
+    ;
+
+    po::positional_options_description p;
+    p.add("image", 1);
+    p.add("label", 1);
+
+    po::variables_map vm;
+    po::store(po::command_line_parser(argc, argv).
+                     options(desc).positional(p).run(), vm);
+    po::notify(vm);
+
+    if (vm.count("help") || image_db_dir.empty()) {
+        cerr << desc;
+        return 1;
+    }
+    CHECK(batch >= 1);
+
+    scoped_ptr<db::DB> image_db(caffex::GetDB(backend));
+    image_db->Open(image_db_dir, db::READ);
+    scoped_ptr<db::Cursor> image_cur(image_db->NewCursor());
+    image_cur->SeekToFirst();
+
+    bool has_label = !label_db_dir.empty();
+    scoped_ptr<db::DB> label_db;
+    scoped_ptr<db::Cursor> label_cur;
+    if (has_label) {
+        label_db.reset(caffex::GetDB(backend));
+        label_db->Open(label_db_dir, db::READ);
+        label_cur.reset(label_db->NewCursor());
+        label_cur->SeekToFirst();
+    }
+
+    Stats total;
+    size_t count = 0;
+    vector<string> ivs, lvs;
+    for (;;) {
+        // the cursors are read sequentially, records are decoded in parallel
+        ivs.clear();
+        lvs.clear();
+        while ((ivs.size() < batch) && image_cur->valid()
+                && ((max_records == 0) || (count < max_records))) {
+            ivs.push_back(image_cur->value());
+            if (has_label) {
+                CHECK(label_cur->valid()) << "label db has fewer records than the image db";
+                // import-images writes both dbs with the same keys
+                CHECK(label_cur->key() == image_cur->key())
+                    << "image key " << image_cur->key() << " does not match label key " << label_cur->key();
+                lvs.push_back(label_cur->value());
+                label_cur->Next();
+            }
+            image_cur->Next();
+            ++count;
+        }
+        if (ivs.empty()) break;
+#pragma omp parallel
+        {
+            Stats local;
+            Datum datum;
+#pragma omp for schedule(dynamic, 1)
+            for (unsigned i = 0; i < ivs.size(); ++i) {
+                CHECK(datum.ParseFromString(ivs[i]));
+                local.addImage(datum);
+                if (has_label) {
+                    CHECK(datum.ParseFromString(lvs[i]));
+                    local.addLabel(datum);
+                }
+            }
+#pragma omp critical
+            total.merge(local);
+        }
+        if (count % (batch * 100) == 0) {
+            LOG(INFO) << count << " records processed.";
+        }
+    }
+    CHECK(total.pixels > 0) << "empty db";
+
+    vector<double> means(3), stds(3);
+    for (unsigned c = 0; c < 3; ++c) {
+        means[c] = total.sum[c] / total.pixels;
+        stds[c] = std::sqrt(std::max(0.0, total.sum2[c] / total.pixels - means[c] * means[c]));
+    }
+    cout << "images\t" << total.images << endl;
+    cout << "pixels\t" << total.pixels << endl;
+    cout << "mean\t" << means[0] << ' ' << means[1] << ' ' << means[2] << endl;
+    cout << "std\t" << stds[0] << ' ' << stds[1] << ' ' << stds[2] << endl;
+    if (has_label) {
+        // median frequency balancing: weight = median(freq) / freq
+        vector<pair<unsigned, double>> freqs;
+        size_t labeled = 0;
+        for (unsigned i = 0; i < total.classes.size(); ++i) {
+            labeled += total.classes[i];
+        }
+        for (unsigned i = 0; i < total.classes.size(); ++i) {
+            if (total.classes[i] == 0) continue;
+            freqs.emplace_back(i, 1.0 * total.classes[i] / labeled);
+        }
+        vector<double> fs;
+        for (auto const &p: freqs) fs.push_back(p.second);
+        sort(fs.begin(), fs.end());
+        if (fs.empty()) LOG(WARNING) << "no label pixels";
+        double median = fs.empty() ? 0 : fs[fs.size() / 2];
+        for (auto const &p: freqs) {
+            cout << "class\t" << p.first << '\t' << total.classes[p.first] << '\t' << p.second << '\t' << median / p.second << endl;
+        }
+    }
+    for (auto const &p: sorted(total.sides)) {
+        cout << "side\t" << p.first * size_bin << '-' << (p.first + 1) * size_bin - 1 << '\t' << p.second << endl;
+    }
+    for (auto const &p: sorted(total.aspects)) {
+        cout << "aspect\t" << std::pow(2.0, p.first * aspect_bin) << '-' << std::pow(2.0, (p.first + 1) * aspect_bin) << '\t' << p.second << endl;
+    }
+    // the most frequent shapes are the natural bucket sizes for batched inference
+    vector<pair<size_t, uint64_t>> shapes;
+    for (auto const &p: total.shapes) {
+        shapes.emplace_back(p.second, p.first);
+    }
+    sort(shapes.rbegin(), shapes.rend());
+    for (unsigned i = 0; (i < shapes.size()) && (i < top); ++i) {
+        cout << "shape\t" << (shapes[i].second >> 32) << 'x' << (shapes[i].second & 0xFFFFFFFF) << '\t' << shapes[i].first << endl;
+    }
+
+    if (mean_path.size()) {
+        // textual format understood by Caffex
+        ofstream os(mean_path.c_str());
+        os << means[0] << ' ' << means[1] << ' ' << means[2] << endl;
+        CHECK(os) << "failed to write " << mean_path;
+    }
+
+    return 0;
+}
+
@@ -0,0 +1,626 @@
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <ctime>
+#include <iterator>
+#include <boost/static_assert.hpp>
+#include <boost/throw_exception.hpp>
+#include <curl/curl.h>
+#include <glog/logging.h>
+#include "download.h"
+
+namespace caffex {
+
+bool IsURL (std::string const &url) {
+    if (url.compare(0, 7, "http://") == 0) return true;
+    if (url.compare(0, 8, "https://") == 0) return true;
+    if (url.compare(0, 6, "ftp://") == 0) return true;
+    return false;
+}   
+
+static uint32_t now () {
+    return std::time(nullptr);
+}
+
+static void hex (uint32_t const *digest, string *checksum) {
+    static char const digits[] = "0123456789abcdef";
+    checksum->clear();
+    for (unsigned i = 0; i < 5; ++i) {
+        uint32_t c = digest[i];
+        for (int shift = 28; shift >= 0; shift -= 4) {
+            checksum->push_back(digits[(c >> shift) & 0xF]);
+        }
+    }
+}
+
+DownloadCache::DownloadCache (fs::path const &dir_, uint64_t budget_, unsigned failure_ttl_)
+    : dir(dir_), budget(budget_), failure_ttl(failure_ttl_),
+    total_size(0), log_size(0), log(nullptr)
+{
+    fs::create_directories(dir);
+    fs::path index = dir / fs::path("index");
+    FILE *f = fopen(index.c_str(), "rb");
+    if (f) {
+        Record rec;
+        while (fread(&rec, sizeof(rec), 1, f) == 1) {
+            apply(rec);
+            ++log_size;
+        }
+        fclose(f);
+    }
+    compact();
+    evict();
+    LOG(INFO) << "Download cache " << dir << ": " << lru.size() << " files, " << total_size << " bytes.";
+}
+
+DownloadCache::~DownloadCache () {
+    if (log) {
+        fclose(log);
+    }
+}
+
+void DownloadCache::digest (string const &url, Record *rec) const {
+    Checksum(&url[0], url.size(), rec->digest);
+    rec->size = 0;
+    rec->atime = now();
+    rec->status = CACHED;
+}
+
+fs::path DownloadCache::path (Record const &rec) const {
+    string sum;
+    hex(rec.digest, &sum);
+    return dir / fs::path(sum.substr(0, 2)) / fs::path(sum.substr(2, 2)) / fs::path(sum);
+}
+
+fs::path DownloadCache::path (string const &url) const {
+    Record rec;
+    digest(url, &rec);
+    return path(rec);
+}
+
+void DownloadCache::apply (Record const &rec) {
+    uint64_t k = key(rec);
+    auto it = entries.find(k);
+    if (it != entries.end()) {
+        if (it->second.rec.status == CACHED) {
+            total_size -= it->second.rec.size;
+            lru.erase(it->second.lru);
+        }
+        if (rec.status == REMOVED) {
+            entries.erase(it);
+            return;
+        }
+    }
+    else if (rec.status == REMOVED) {
+        return;
+    }
+    Entry &e = entries[k];
+    e.rec = rec;
+    if (rec.status == CACHED) {
+        total_size += rec.size;
+        lru.push_front(k);
+        e.lru = lru.begin();
+    }
+}
+
+// Called after apply(rec), so a compaction keeps rec.
+void DownloadCache::append (Record const &rec) {
+    CHECK(fwrite(&rec, sizeof(rec), 1, log) == 1);
+    ++log_size;
+    if (log_size > 2 * entries.size() + 4096) {
+        compact();
+    }
+}
+
+void DownloadCache::compact () {
+    // rewrite the index with one record per entry, least recently used first,
+    // so replaying it restores the LRU order
+    fs::path index = dir / fs::path("index");
+    fs::path tmp = dir / fs::path("index.tmp");
+    if (log) {
+        fclose(log);
+    }
+    // failures past their ttl would be retried anyway, forget them
+    uint64_t t = now();
+    for (auto it = entries.begin(); it != entries.end(); ) {
+        Record const &rec = it->second.rec;
+        if ((rec.status == FAILED) && (rec.atime + uint64_t(failure_ttl) <= t)) {
+            it = entries.erase(it);
+        }
+        else ++it;
+    }
+    FILE *f = fopen(tmp.c_str(), "wb");
+    PCHECK(f) << "cannot create " << tmp;
+    for (auto const &e: entries) {
+        if (e.second.rec.status != CACHED) {
+            CHECK(fwrite(&e.second.rec, sizeof(Record), 1, f) == 1);
+        }
+    }
+    for (auto it = lru.rbegin(); it != lru.rend(); ++it) {
+        CHECK(fwrite(&entries[*it].rec, sizeof(Record), 1, f) == 1);
+    }
+    PCHECK(fclose(f) == 0);
+    fs::rename(tmp, index);
+    log_size = entries.size();
+    log = fopen(index.c_str(), "ab");
+    PCHECK(log) << "cannot open " << index;
+}
+
+void DownloadCache::evict () {
+    // it: the least recently used entry kept so far, all after it are pinned
+    auto it = lru.end();
+    while ((budget > 0) && (total_size > budget) && (it != lru.begin())) {
+        auto victim = std::prev(it);
+        if (pins.count(*victim)) {
+            it = victim;
+            continue;
+        }
+        Record rec = entries[*victim].rec;
+        boost::system::error_code ec;
+        fs::remove(path(rec), ec);
+        rec.status = REMOVED;
+        apply(rec);
+        append(rec);
+    }
+}
+
+bool DownloadCache::lookup (string const &url, bool *failed) {
+    Record rec;
+    digest(url, &rec);
+    fs::path p = path(rec);
+    if (failed) *failed = false;
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(key(rec));
+    if (it == entries.end()) {
+        // file left by an interrupted run, adopt it
+        if (!fs::exists(p)) return false;
+        rec.size = fs::file_size(p);
+        apply(rec);
+        append(rec);
+        evict();
+        return true;
+    }
+    Entry &e = it->second;
+    if (e.rec.status == FAILED) {
+        if (failed && (rec.atime < e.rec.atime + failure_ttl)) {
+            *failed = true;
+        }
+        return false;
+    }
+    if (!fs::exists(p)) {
+        // removed behind our back
+        rec.status = REMOVED;
+        apply(rec);
+        append(rec);
+        return false;
+    }
+    lru.splice(lru.begin(), lru, e.lru);
+    if (e.rec.atime != rec.atime) {
+        e.rec.atime = rec.atime;
+        append(e.rec);
+    }
+    return true;
+}
+
+void DownloadCache::insert (string const &url) {
+    Record rec;
+    digest(url, &rec);
+    rec.size = fs::file_size(path(rec));
+    std::lock_guard<std::mutex> lock(mutex);
+    apply(rec);
+    append(rec);
+    evict();
+}
+
+void DownloadCache::fail (string const &url) {
+    Record rec;
+    digest(url, &rec);
+    rec.status = FAILED;
+    std::lock_guard<std::mutex> lock(mutex);
+    apply(rec);
+    append(rec);
+}
+
+void DownloadCache::pin (string const &url) {
+    Record rec;
+    digest(url, &rec);
+    std::lock_guard<std::mutex> lock(mutex);
+    ++pins[key(rec)];
+}
+
+void DownloadCache::unpin (string const &url) {
+    Record rec;
+    digest(url, &rec);
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = pins.find(key(rec));
+    CHECK(it != pins.end()) << url << " is not pinned";
+    if (--it->second == 0) {
+        pins.erase(it);
+        // evictions may have been held back by the pin
+        evict();
+    }
+}
+
+static size_t write_file (char *ptr, size_t size, size_t nmemb, void *userdata) {
+    return fwrite(ptr, size, nmemb, reinterpret_cast<FILE *>(userdata));
+}
+
+Downloader::Downloader (Config const &config_)
+    : config(config_),
+    cache(config.cache_dir, config.cache_size, config.failure_ttl),
+    stop(false)
+{
+    static std::once_flag curl_init;
+    std::call_once(curl_init, []() {
+        CHECK(curl_global_init(CURL_GLOBAL_ALL) == 0);
+    });
+    if (config.threads <= 0) config.threads = 1;
+    if (config.timeout <= 0) config.timeout = 5;
+    for (int i = 0; i < config.threads; ++i) {
+        workers.emplace_back([this]() { worker(); });
+    }
+}
+
+Downloader::~Downloader () {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    queue_cv.notify_all();
+    for (auto &th: workers) {
+        th.join();
+    }
+}
+
+void Downloader::prefetch (string const &url) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!prefetched.insert(url).second) return;
+        cache.pin(url);
+    }
+    bool failed;
+    if (cache.lookup(url, &failed) || failed) return;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (states.count(url)) return;
+    states[url] = QUEUED;
+    queue.push_back(url);
+    queue_cv.notify_one();
+}
+
+fs::path Downloader::fetch (string const &url) {
+    fs::path p = path(url);
+    {
+        // take over the pin of prefetch(), or pin now
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!prefetched.erase(url)) cache.pin(url);
+    }
+    bool failed;
+    if (cache.lookup(url, &failed) || failed) return p;
+    std::unique_lock<std::mutex> lock(mutex);
+    auto it = states.find(url);
+    if (it == states.end()) {
+        states[url] = QUEUED;
+        queue.push_front(url);
+        queue_cv.notify_one();
+    }
+    else if (it->second == QUEUED) {
+        // jump the queue, the stale entry is skipped by the workers
+        queue.push_front(url);
+        queue_cv.notify_one();
+    }
+    done_cv.wait(lock, [this, &url]() { return states.count(url) == 0; });
+    return p;
+}
+
+void Downloader::release (string const &url) {
+    cache.unpin(url);
+}
+
+void Downloader::worker () {
+    CURL *curl = curl_easy_init();
+    CHECK(curl);
+    for (;;) {
+        string url;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            queue_cv.wait(lock, [this]() { return stop || !queue.empty(); });
+            if (queue.empty()) break;
+            url = queue.front();
+            queue.pop_front();
+            auto it = states.find(url);
+            if ((it == states.end()) || (it->second != QUEUED)) continue;
+            it->second = RUNNING;
+        }
+        fs::path p = path(url);
+        bool ok = false;
+        for (int t = 0; !ok && (t <= config.retries); ++t) {
+            if (t > 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(100 << t));
+            }
+            ok = download(curl, url, p);
+        }
+        if (ok) {
+            cache.insert(url);
+        }
+        else {
+            LOG(ERROR) << "Failed to download " << url;
+            cache.fail(url);
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            states.erase(url);
+        }
+        done_cv.notify_all();
+    }
+    curl_easy_cleanup(curl);
+}
+
+bool Downloader::download (void *handle, string const &url, fs::path const &p) {
+    CURL *curl = reinterpret_cast<CURL *>(handle);
+    // download to a private file and rename, so readers never see a partial file
+    fs::path tmp = p;
+    tmp += fs::unique_path(".%%%%-%%%%");
+    fs::create_directories(p.parent_path());
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if (!f) {
+        LOG(ERROR) << "Cannot create " << tmp;
+        return false;
+    }
+    // reset clears the options but keeps the connection cache
+    curl_easy_reset(curl);
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_file);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, f);
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);    // same as wget --no-check-certificate
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, long(config.timeout));
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, long(config.timeout) * 4);
+    if (config.agent.size()) {
+        curl_easy_setopt(curl, CURLOPT_USERAGENT, config.agent.c_str());
+    }
+    CURLcode r = curl_easy_perform(curl);
+    long code = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+    bool ok = (fclose(f) == 0) && (r == CURLE_OK)
+              && ((code == 200) || (code == 0 /* ftp */ ) || (code == 226));
+    if (ok) {
+        fs::rename(tmp, p);
+    }
+    else {
+        LOG(INFO) << "download " << url << ": " << curl_easy_strerror(r) << ", status " << code;
+        fs::remove(tmp);
+    }
+    return ok;
+}
+
+namespace from_boost_uuid_detail {
+
+BOOST_STATIC_ASSERT(sizeof(unsigned char)*8 == 8);
+BOOST_STATIC_ASSERT(sizeof(unsigned int)*8 == 32);
+
+inline unsigned int left_rotate(unsigned int x, std::size_t n)
+{
+    return (x<<n) ^ (x>> (32-n));
+}
+
+class sha1
+{
+public:
+    typedef unsigned int(&digest_type)[5];
+public:
+    sha1();
+
+    void reset();
+
+    void process_byte(unsigned char byte);
+    void process_block(void const* bytes_begin, void const* bytes_end);
+    void process_bytes(void const* buffer, std::size_t byte_count);
+
+    void get_digest(digest_type digest);
+
+private:
+    void process_block();
+    void process_byte_impl(unsigned char byte);
+    void add_bit_count(std::size_t bits);
+
+private:
+    unsigned int h_[5];
+
+    unsigned char block_[64];
+
+    std::size_t block_byte_index_;
+    std::size_t bit_count_low;
+    std::size_t bit_count_high;
+};
+
+inline sha1::sha1()
+{
+    reset();
+}
+
+inline void sha1::reset()
+{
+    h_[0] = 0x67452301;
+    h_[1] = 0xEFCDAB89;
+    h_[2] = 0x98BADCFE;
+    h_[3] = 0x10325476;
+    h_[4] = 0xC3D2E1F0;
+
+    block_byte_index_ = 0;
+    bit_count_low = 0;
+    bit_count_high = 0;
+}
+
+inline void sha1::process_byte(unsigned char byte)
+{
+    process_byte_impl(byte);
+
+    if (bit_count_low < 0xFFFFFFF8) {
+        bit_count_low += 8;
+    } else {
+        bit_count_low = 0;
+
+        if (bit_count_high <= 0xFFFFFFFE) {
+            ++bit_count_high;
+        } else {
+            BOOST_THROW_EXCEPTION(std::runtime_error("sha1 too many bytes"));
+        }
+    }
+}
+
+inline void sha1::process_byte_impl(unsigned char byte)
+{
+    block_[block_byte_index_++] = byte;
+
+    if (block_byte_index_ == 64) {
+        block_byte_index_ = 0;
+        process_block();
+    }
+}
+
+inline void sha1::add_bit_count(std::size_t bits)
+{
+    // the count is a 64-bit number kept in two 32-bit halves
+    uint64_t count = (uint64_t(bit_count_high) << 32) | bit_count_low;
+    count += bits;
+    bit_count_low = count & 0xFFFFFFFF;
+    bit_count_high = count >> 32;
+}
+
+inline void sha1::process_block(void const* bytes_begin, void const* bytes_end)
+{
+    unsigned char const* begin = static_cast<unsigned char const*>(bytes_begin);
+    unsigned char const* end = static_cast<unsigned char const*>(bytes_end);
+    // complete a pending partial block
+    for(; (begin != end) && (block_byte_index_ != 0); ++begin) {
+        process_byte(*begin);
+    }
+    // whole blocks go straight to the compression function
+    for(; end - begin >= 64; begin += 64) {
+        std::memcpy(block_, begin, 64);
+        process_block();
+        add_bit_count(512);
+    }
+    for(; begin != end; ++begin) {
+        process_byte(*begin);
+    }
+}
+
+inline void sha1::process_bytes(void const* buffer, std::size_t byte_count)
+{
+    unsigned char const* b = static_cast<unsigned char const*>(buffer);
+    process_block(b, b+byte_count);
+}
+
+inline void sha1::process_block()
+{
+    unsigned int w[80];
+    for (std::size_t i=0; i<16; ++i) {
+        w[i]  = (block_[i*4 + 0] << 24);
+        w[i] |= (block_[i*4 + 1] << 16);
+        w[i] |= (block_[i*4 + 2] << 8);
+        w[i] |= (block_[i*4 + 3]);
+    }
+    for (std::size_t i=16; i<80; ++i) {
+        w[i] = left_rotate((w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16]), 1);
+    }
+
+    unsigned int a = h_[0];
+    unsigned int b = h_[1];
+    unsigned int c = h_[2];
+    unsigned int d = h_[3];
+    unsigned int e = h_[4];
+
+    for (std::size_t i=0; i<80; ++i) {
+        unsigned int f;
+        unsigned int k;
+
+        if (i<20) {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+        } else if (i<40) {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        } else if (i<60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+
+        unsigned temp = left_rotate(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = left_rotate(b, 30);
+        b = a;
+        a = temp;
+    }
+
+    h_[0] += a;
+    h_[1] += b;
+    h_[2] += c;
+    h_[3] += d;
+    h_[4] += e;
+}
+
+inline void sha1::get_digest(digest_type digest)
+{
+    // append the bit '1' to the message
+    process_byte_impl(0x80);
+
+    // append k bits '0', where k is the minimum number >= 0
+    // such that the resulting message length is congruent to 56 (mod 64)
+    // check if there is enough space for padding and bit_count
+    if (block_byte_index_ > 56) {
+        // finish this block
+        while (block_byte_index_ != 0) {
+            process_byte_impl(0);
+        }
+
+        // one more block
+        while (block_byte_index_ < 56) {
+            process_byte_impl(0);
+        }
+    } else {
+        while (block_byte_index_ < 56) {
+            process_byte_impl(0);
+        }
+    }
+
+    // append length of message (before pre-processing) 
+    // as a 64-bit big-endian integer
+    process_byte_impl( static_cast<unsigned char>((bit_count_high>>24) & 0xFF) );
+    process_byte_impl( static_cast<unsigned char>((bit_count_high>>16) & 0xFF) );
+    process_byte_impl( static_cast<unsigned char>((bit_count_high>>8 ) & 0xFF) );
+    process_byte_impl( static_cast<unsigned char>((bit_count_high)     & 0xFF) );
+    process_byte_impl( static_cast<unsigned char>((bit_count_low>>24) & 0xFF) );
+    process_byte_impl( static_cast<unsigned char>((bit_count_low>>16) & 0xFF) );
+    process_byte_impl( static_cast<unsigned char>((bit_count_low>>8 ) & 0xFF) );
+    process_byte_impl( static_cast<unsigned char>((bit_count_low)     & 0xFF) );
+
+    // get final digest
+    digest[0] = h_[0];
+    digest[1] = h_[1];
+    digest[2] = h_[2];
+    digest[3] = h_[3];
+    digest[4] = h_[4];
+}
+}
+
+void Checksum (void const *data, unsigned length, uint32_t (&digest)[5]) {
+    from_boost_uuid_detail::sha1 sha1;
+    sha1.process_bytes(data, length);
+    sha1.get_digest(digest);
+}
+
+void Checksum (void const *data, unsigned length, std::string *checksum) {
+    uint32_t digest[5];
+    Checksum(data, length, digest);
+    hex(digest, checksum);
+}
+
+}
+
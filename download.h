@@ -0,0 +1,150 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <unordered_set>
+#include <list>
+#include <cstdio>
+#include <cstdint>
+#include <boost/filesystem.hpp>
+
+namespace caffex {
+
+using std::string;
+using std::vector;
+namespace fs = boost::filesystem;
+
+bool IsURL (string const &url);
+void Checksum (void const *data, unsigned length, string *checksum);
+void Checksum (void const *data, unsigned length, uint32_t (&digest)[5]);
+
+// Size-bounded download cache.
+// A file is stored under its SHA1 name in a two-level fan-out directory,
+// e.g. cache/a9/99/a9993e36..., so no directory grows beyond a few
+// thousand entries.  The file cache/index is an append-only log of
+// fixed-size records (URL digest, size, last access, status); it is
+// replayed on startup to rebuild the LRU order and compacted when it
+// grows too long.  When the total size exceeds the budget, the least
+// recently used files are removed, except pinned ones, which are about
+// to be read.  Failed downloads are remembered for failure_ttl seconds so
+// dead URLs are not retried on every run.
+class DownloadCache {
+public:
+    DownloadCache (fs::path const &dir, uint64_t budget = 0, unsigned failure_ttl = 86400);
+    ~DownloadCache ();
+    fs::path path (string const &url) const;
+    // returns true and marks the entry as recently used if url is cached,
+    // *failed is set if the last download of url failed recently
+    bool lookup (string const &url, bool *failed = nullptr);
+    // record a successful download already stored at path(url)
+    void insert (string const &url);
+    // record a failed download
+    void fail (string const &url);
+    // a pinned url is not evicted, pins nest; url need not be cached yet
+    void pin (string const &url);
+    void unpin (string const &url);
+    uint64_t size () const {
+        return total_size;
+    }
+
+private:
+    enum Status {
+        CACHED = 1,
+        FAILED = 2,
+        REMOVED = 3
+    };
+    struct Record {             // on-disk index entry, 32 bytes
+        uint32_t digest[5];
+        uint32_t size;
+        uint32_t atime;
+        uint32_t status;
+    };
+    struct Entry {
+        Record rec;
+        std::list<uint64_t>::iterator lru;  // only valid for CACHED entries
+    };
+    fs::path dir;
+    uint64_t budget;
+    unsigned failure_ttl;
+    std::mutex mutex;
+    std::unordered_map<uint64_t, Entry> entries;
+    std::list<uint64_t> lru;    // most recently used first
+    std::unordered_map<uint64_t, unsigned> pins;
+    uint64_t total_size;
+    size_t log_size;            // records in the index file
+    FILE *log;
+
+    static uint64_t key (Record const &rec) {
+        return (uint64_t(rec.digest[0]) << 32) | rec.digest[1];
+    }
+    fs::path path (Record const &rec) const;
+    void digest (string const &url, Record *rec) const;
+    void apply (Record const &rec);
+    void append (Record const &rec);
+    void compact ();
+    void evict ();
+};
+
+// In-process concurrent downloader backed by an on-disk cache.
+// Each worker thread owns one libcurl handle, so connections to the same
+// host are kept alive and reused across requests.  URLs can be queued with
+// prefetch() well before they are needed; fetch() moves a URL to the
+// front of the queue if necessary and blocks until it is in the cache.
+// A URL stays pinned in the cache from prefetch() or fetch() until the
+// caller is done with the file and calls release().
+class Downloader {
+public:
+    struct Config {
+        fs::path cache_dir;
+        string agent;
+        int threads;
+        int timeout;    // seconds
+        int retries;
+        uint64_t cache_size;    // bytes, 0 for unlimited
+        unsigned failure_ttl;   // seconds before a failed URL is retried
+        Config (): cache_dir(".caffex_cache"), threads(16), timeout(5), retries(3),
+            cache_size(0), failure_ttl(86400) {
+        }
+    };
+
+    Downloader (Config const &);
+    ~Downloader ();
+
+    // cache location of url, the file does not necessarily exist
+    fs::path path (string const &url) const {
+        return cache.path(url);
+    }
+    // queue url for download, returns immediately
+    void prefetch (string const &url);
+    // returns the cache path of url after it is downloaded,
+    // the path does not exist if the download failed;
+    // each fetch() must be followed by a release()
+    fs::path fetch (string const &url);
+    void release (string const &url);
+
+private:
+    enum State {
+        QUEUED,
+        RUNNING
+    };
+    Config config;
+    DownloadCache cache;
+    std::mutex mutex;
+    std::condition_variable queue_cv;   // signals workers
+    std::condition_variable done_cv;    // signals fetch()
+    std::deque<string> queue;
+    std::unordered_map<string, State> states;   // URLs not yet finished
+    std::unordered_set<string> prefetched;      // pinned, not yet fetched
+    vector<std::thread> workers;
+    bool stop;
+
+    void worker ();
+    bool download (void *curl, string const &url, fs::path const &path);
+};
+
+}
+
@@ -2,185 +2,93 @@
 #include <string>
 #include <utility>
 #include <vector>
+#include <deque>
 #include <algorithm>
 #include <memory>
-#include <random>
-#include <boost/scoped_ptr.hpp>
 #include <boost/lexical_cast.hpp>
-#include <boost/format.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/program_options.hpp>
-#include <boost/progress.hpp>
 #include <boost/algorithm/string/split.hpp>
 #include <boost/algorithm/string/trim.hpp>
 #include <opencv2/opencv.hpp>
-#include <cppformat/format.h>
-#include <json11.hpp>
 #include "glog/logging.h"
+#include "annotation.h"
+#include "download.h"
 
 using namespace std;
 using namespace boost;
-using namespace json11;
 namespace fs = boost::filesystem;
 
-class Shape {
-public:
-    virtual void draw (cv::Mat *, cv::Scalar v, int thickness = CV_FILLED) const = 0;
-    static std::shared_ptr<Shape> create (Json const &geo);
-};
-
-class Box: public Shape {
-    cv::Rect_<float> rect;
-public:
-    Box (Json const &geo) {
-        rect.x = geo["x"].number_value();
-        rect.y = geo["y"].number_value();
-        rect.width = geo["width"].number_value();
-        rect.height = geo["height"].number_value();
-    }
-    virtual void draw (cv::Mat *m, cv::Scalar v, int thickness) const {
-        cv::Rect box;
-        box.x = std::round(m->cols * rect.x);
-        box.y = std::round(m->rows * rect.y);
-        box.width = std::round(m->cols * rect.width);
-        box.height = std::round(m->rows * rect.height);
-        cv::rectangle(*m, box, v, thickness);
-    }
-};
-
-class Poly: public Shape {
-    vector<cv::Point2f> points;
-public:
-    Poly (Json const &geo) {
-        for (auto const &p: geo["points"].array_items()) {
-            points.emplace_back(p["x"].number_value(), p["y"].number_value());
-        }
-    }
-    virtual void draw (cv::Mat *m, cv::Scalar v, int thickness) const {
-        vector<cv::Point> ps(points.size());
-        for (unsigned i = 0; i < ps.size(); ++i) {
-            auto const &from = points[i];
-            auto &to = ps[i];
-            to.x = std::round(from.x * m->cols);
-            to.y = std::round(from.y * m->rows);
-        }
-        cv::Point const *pps = &ps[0];
-        int const nps = ps.size();
-        if (thickness == CV_FILLED) {
-            cv::fillPoly(*m, &pps, &nps, 1, v);
-        }
-        else {
-            cv::polylines(*m, &pps, &nps, 1, true, v, thickness);
-        }
-    }
-};
-
-std::shared_ptr<Shape> Shape::create (Json const &geo) {
-    string type = geo["type"].string_value();
-    if (type == "rect") {
-        return std::shared_ptr<Shape>(new Box(geo["geometry"]));
-    }
-    else if (type == "polygon") {
-        return std::shared_ptr<Shape>(new Poly(geo["geometry"]));
-    }
-}
-
-class Annotation {
-    vector<std::shared_ptr<Shape>> shapes;
-public:
-    Annotation () {}
-    Annotation (string const &txt) {
-        string err;
-        Json json = Json::parse(txt, err);
-        if (err.size()) {
-            LOG(ERROR) << "Bad json: " << err << " (" << txt << ")";
-            return;
-        }
-        for (auto const &x: json["shapes"].array_items()) {
-            shapes.emplace_back(Shape::create(x));
-        }
-    }
-
-    void draw (cv::Mat *m, cv::Scalar v, int thickness = -1) const {
-        for (auto const &p: shapes) {
-            p->draw(m, v, thickness);
-        }
-    }
-};
-
-
 struct Sample {
     string url;
-    Annotation anno;
+    string anno;
 };
 
-bool IsURL (std::string const &url) {
-    if (url.compare(0, 7, "http://") == 0) return true;
-    if (url.compare(0, 8, "https://") == 0) return true;
-    if (url.compare(0, 6, "ftp://") == 0) return true;
-    return false;
-}   
-
-string download_agent;
-int download_timeout = 5;
-fs::path temp_dir("/tmp");
-
-fs::path temp_path (const fs::path& model="%%%%-%%%%-%%%%-%%%%") {
-    return fs::unique_path(temp_dir / model);
-}
-
-void Download (const std::string &url, fs::path const &path) {
-    int timeout = download_timeout;
-    if (timeout <= 0) {
-        timeout = 5;
-    }
-    ostringstream ss;
-    ss << "wget --output-document=" << path.native() << " --tries=1 -nv --no-check-certificate";
-    ss << " --quiet --timeout=" << timeout;
-    if (download_agent.size()) {
-        ss << " --user-agent=" << download_agent;
-    }
-    ss << ' ' << '"' << url << '"';
-    string cmd = ss.str();
-    LOG(INFO) << cmd;
-    ::system(cmd.c_str()) == 0;
-}
+std::unique_ptr<caffex::Downloader> downloader;
+int thickness = 3;
 
 cv::Mat imreadx (string const &url) {
     cv::Mat v;
-    if (IsURL(url)) {
-        fs::path path = temp_path();
-        Download(url, path);
+    if (caffex::IsURL(url)) {
+        fs::path path = downloader->fetch(url);
         v = cv::imread(path.native(), -1);
+        downloader->release(url);
         if (!v.data) {
             LOG(ERROR) << "Failed to download " << url;
         }
-        fs::remove(path);
     }
     else {
         v = cv::imread(url, -1);
     }
-
-    if (!v.data) return v;
     // TODO! support color image
     return v;
 }
 
+bool Render (Sample const &s, fs::path const &output_path) {
+    cv::Mat image = imreadx(s.url);
+    if (!image.data) return false;
+    caffex::Annotation anno(s.anno);
+    if (image.channels() == 1) {
+        anno.draw(&image, cv::Scalar(0), 1);
+    }
+    else {
+        anno.draw(&image, cv::Scalar(0, 0, 0xFF), thickness);
+    }
+    if (!cv::imwrite(output_path.native(), image)) {
+        LOG(ERROR) << "Failed to write " << output_path;
+        return false;
+    }
+    return true;
+}
+
 int main(int argc, char **argv) {
     namespace po = boost::program_options; 
     string output_path;
-    int thickness;
+    fs::path output_dir;
+    string list_path;
+    unsigned batch;
+    unsigned prefetch;
+    caffex::Downloader::Config config;
+    unsigned cache_size;
 
     po::options_description desc("Allowed options");
     desc.add_options()
     ("help,h", "produce help message.")
-    ("output,o", po::value(&output_path), "")
-    ("timeout", po::value(&download_timeout)->default_value(5), "")
-    ("agent", po::value(&download_agent), "")
+    ("output,o", po::value(&output_path), "render the first valid line to this file")
+    ("dir,d", po::value(&output_dir), "render every line to dir/<line number>.jpg")
+    ("list", po::value(&list_path), "read the list from this file instead of stdin")
+    ("batch", po::value(&batch)->default_value(64), "images rendered in parallel at a time")
+    ("prefetch", po::value(&prefetch)->default_value(512), "number of images to download ahead")
+    ("timeout", po::value(&config.timeout)->default_value(config.timeout), "")
+    ("agent", po::value(&config.agent), "")
+    ("download-threads", po::value(&config.threads)->default_value(config.threads), "concurrent downloads")
+    ("retries", po::value(&config.retries)->default_value(config.retries), "")
+    ("cache", po::value(&config.cache_dir)->default_value(config.cache_dir), "download cache, can be shared with import-images")
+    ("cache-size", po::value(&cache_size)->default_value(0), "cache budget in MB, 0 for unlimited")
+    ("failure-ttl", po::value(&config.failure_ttl)->default_value(config.failure_ttl), "seconds before retrying a failed URL")
     ("log-level,v", po::value(&FLAGS_minloglevel)->default_value(1), "")
-    ("tmp", po::value(&temp_dir), "")
-    ("thickness,t", po::value(&thickness)->default_value(3), "")
+    ("thickness,t", po::value(&thickness)->default_value(thickness), "")
     ;
 
     po::positional_options_description p;
@@ -191,40 +99,79 @@ int main(int argc, char **argv) {
                      options(desc).positional(p).run(), vm);
     po::notify(vm); 
 
-    if (vm.count("help") || output_path.empty()) {
+    if (vm.count("help") || (output_path.empty() && output_dir.empty())) {
         cerr << desc;
         return 1;
     }
+    CHECK(batch >= 1);
 
     google::InitGoogleLogging(argv[0]);
-    Sample s;
-    string line;
-    while (getline(cin, line)) {
-        vector<string> ss;
-        split(ss, line, is_any_of("\t"), token_compress_off);
-        if (ss.size() != 2) {
-            cerr << "Bad line: " << line << endl;
-            continue;
+    config.cache_size = uint64_t(cache_size) << 20;
+    downloader.reset(new caffex::Downloader(config));
+
+    std::unique_ptr<fs::ifstream> list_file;
+    if (list_path.size()) {
+        list_file.reset(new fs::ifstream(list_path));
+        CHECK(*list_file) << "cannot open " << list_path;
+    }
+    istream &is = list_file ? *list_file : cin;
+    // returns false at the end of the list
+    auto read = [&is](Sample *s) {
+        string line;
+        while (getline(is, line)) {
+            vector<string> ss;
+            split(ss, line, is_any_of("\t"), token_compress_off);
+            if ((ss.size() != 2) && (ss.size() != 3)) {     // weighted lists from caffex-mine
+                cerr << "Bad line: " << line << endl;
+                continue;
+            }
+            s->url = ss[0];
+            s->anno = ss[1];
+            return true;
         }
-        s.url = ss[0];
-        s.anno = Annotation(ss[1]);
-        /*
-        if (!fs::is_regular_file(fs::path(root_dir + path))) {
-            LOG(ERROR) << "Cannot find regular file: " << path;
-            continue;
+        return false;
+    };
+
+    if (output_dir.empty()) {
+        Sample s;
+        while (read(&s)) {
+            if (Render(s, output_path)) break;
+        }
+        return 0;
+    }
+
+    fs::create_directories(output_dir);
+    // samples are downloaded by the downloader threads up to `prefetch`
+    // ahead, then decoded, drawn and encoded `batch` at a time in parallel
+    std::deque<pair<unsigned, Sample>> ahead;
+    unsigned n = 0;
+    bool more = true;
+    vector<pair<unsigned, Sample>> todo;
+    vector<char> ok;
+    for (;;) {
+        while (more && (ahead.size() < batch + prefetch)) {
+            Sample s;
+            more = read(&s);
+            if (!more) break;
+            if (caffex::IsURL(s.url)) downloader->prefetch(s.url);
+            ahead.emplace_back(n++, std::move(s));
+        }
+        if (ahead.empty()) break;
+        todo.clear();
+        while ((todo.size() < batch) && !ahead.empty()) {
+            todo.push_back(std::move(ahead.front()));
+            ahead.pop_front();
         }
-        */
-        cv::Mat image = imreadx(s.url);
-        if (image.channels() == 1) {
-            s.anno.draw(&image, cv::Scalar(0), 1);
+        ok.resize(todo.size());
+#pragma omp parallel for schedule(dynamic, 1)
+        for (unsigned i = 0; i < todo.size(); ++i) {
+            ok[i] = Render(todo[i].second, output_dir / (lexical_cast<string>(todo[i].first) + ".jpg"));
         }
-        else {
-            s.anno.draw(&image, cv::Scalar(0, 0, 0xFF), thickness);
+        for (unsigned i = 0; i < todo.size(); ++i) {
+            if (!ok[i]) continue;
+            cout << todo[i].first << '\t' << todo[i].second.url << endl;
         }
-        cv::imwrite(output_path, image);
-        break;
     }
 
     return 0;
 }
-
@@ -5,6 +5,8 @@
 #include <algorithm>
 #include <memory>
 #include <random>
+#include <deque>
+#include <iterator>
 #include <boost/scoped_ptr.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/format.hpp>
@@ -16,159 +18,230 @@
 #include <boost/algorithm/string/trim.hpp>
 #include <opencv2/opencv.hpp>
 #include <cppformat/format.h>
-#include <json11.hpp>
 #include "glog/logging.h"
 #include "caffe/proto/caffe.pb.h"
 #include "caffe/util/db.hpp"
 #include "caffe/util/io.hpp"
 #include "caffe/util/rng.hpp"
+#include "shard.h"
+#include "download.h"
+#include "annotation.h"
 
 using namespace std;
 using namespace boost;
-using namespace json11;
 using namespace caffe;  // NOLINT(build/namespaces)
 namespace fs = boost::filesystem;
 
 string backend("lmdb");
 
-class Shape {
-public:
-    virtual void draw (cv::Mat *, cv::Scalar v, int thickness = CV_FILLED) const = 0;
-    static std::shared_ptr<Shape> create (Json const &geo);
+struct Sample {
+    string url;
+    string anno;    // annotation json, parsed only when the label is drawn
+    unsigned weight;    // copies per training pass, e.g. from caffex-mine
+    unsigned fold;
 };
 
-class Box: public Shape {
-    cv::Rect_<float> rect;
-public:
-    Box (Json const &geo) {
-        rect.x = geo["x"].number_value();
-        rect.y = geo["y"].number_value();
-        rect.width = geo["width"].number_value();
-        rect.height = geo["height"].number_value();
-    }
-    virtual void draw (cv::Mat *m, cv::Scalar v, int thickness) const {
-        cv::Rect box;
-        box.x = std::round(m->cols * rect.x);
-        box.y = std::round(m->rows * rect.y);
-        box.width = std::round(m->cols * rect.width);
-        box.height = std::round(m->rows * rect.height);
-        cv::rectangle(*m, box, v, thickness);
+// url<TAB>anno[<TAB>weight]
+bool ParseLine (string const &line, Sample *s) {
+    vector<string> ss;
+    split(ss, line, is_any_of("\t"), token_compress_off);
+    if ((ss.size() != 2) && (ss.size() != 3)) {
+        return false;
+    }
+    s->url = ss[0];
+    s->anno = ss[1];
+    s->weight = 1;
+    if (ss.size() == 3) {
+        try {
+            s->weight = lexical_cast<unsigned>(ss[2]);
+        }
+        catch (bad_lexical_cast const &) {
+            return false;
+        }
     }
+    return true;
+}
+
+// A list of samples that can be read in several passes.
+// Every sample is assigned to one of F folds when the list is loaded.
+class SampleList {
+public:
+    vector<size_t> fold_sizes;
+    virtual ~SampleList () {}
+    // start a new pass, in a new random order if shuffle
+    virtual void rewind (bool shuffle) = 0;
+    virtual bool read (Sample *) = 0;
 };
 
-class Poly: public Shape {
-    vector<cv::Point2f> points;
+// The whole list is kept in memory.
+class MemoryList: public SampleList {
+    vector<Sample> samples;
+    vector<unsigned> index;
+    unsigned next;
 public:
-    Poly (Json const &geo) {
-        for (auto const &p: geo["points"].array_items()) {
-            points.emplace_back(p["x"].number_value(), p["y"].number_value());
+    MemoryList (string const &path, unsigned F): next(0) {
+        Sample s;
+        ifstream is(path.c_str());
+        string line;
+        while (getline(is, line)) {
+            if (!ParseLine(line, &s)) {
+                cerr << "Bad line: " << line << endl;
+                continue;
+            }
+            samples.push_back(s);
         }
-    }
-    virtual void draw (cv::Mat *m, cv::Scalar v, int thickness) const {
-        vector<cv::Point> ps(points.size());
-        for (unsigned i = 0; i < ps.size(); ++i) {
-            auto const &from = points[i];
-            auto &to = ps[i];
-            to.x = std::round(from.x * m->cols);
-            to.y = std::round(from.y * m->rows);
+        LOG(INFO) << "Loaded " << samples.size() << " samples." << endl;
+        if (F > 1) {
+            random_shuffle(samples.begin(), samples.end());
         }
-        cv::Point const *pps = &ps[0];
-        int const nps = ps.size();
-        if (thickness == CV_FILLED) {
-            cv::fillPoly(*m, &pps, &nps, 1, v);
+        fold_sizes.resize(F, 0);
+        index.resize(samples.size());
+        for (unsigned i = 0; i < samples.size(); ++i) {
+            samples[i].fold = i % F;
+            ++fold_sizes[i % F];
+            index[i] = i;
         }
-        else {
-            cv::polylines(*m, &pps, &nps, 1, true, v, thickness);
+    }
+    virtual void rewind (bool shuffle) {
+        if (shuffle) {
+            random_shuffle(index.begin(), index.end());
         }
+        next = 0;
+    }
+    virtual bool read (Sample *s) {
+        if (next >= index.size()) return false;
+        *s = samples[index[next++]];
+        return true;
     }
 };
 
-std::shared_ptr<Shape> Shape::create (Json const &geo) {
-    string type = geo["type"].string_value();
-    if (type == "rect") {
-        return std::shared_ptr<Shape>(new Box(geo["geometry"]));
-    }
-    else if (type == "polygon") {
-        return std::shared_ptr<Shape>(new Poly(geo["geometry"]));
+// Bounded-memory external shuffle for lists that do not fit in memory.
+// The list is cut into chunks of `chunk` lines; each chunk is shuffled in
+// memory, tagged with folds and written to a temporary file.  A pass then
+// interleaves the chunk files, picking the next line from a chunk with
+// probability proportional to the number of lines it has left.
+class ChunkedList: public SampleList {
+    fs::path dir;
+    vector<size_t> chunk_sizes;
+    vector<size_t> remain;
+    vector<std::shared_ptr<ifstream>> streams;
+    size_t total_remain;
+    std::default_random_engine e;
+
+    fs::path chunk_path (unsigned c) const {
+        return dir / fs::path(lexical_cast<string>(c));
     }
-}
 
-class Annotation {
-    vector<std::shared_ptr<Shape>> shapes;
+    void dump (vector<Sample> *chunk, unsigned F, size_t *count) {
+        random_shuffle(chunk->begin(), chunk->end());
+        fs::ofstream os(chunk_path(chunk_sizes.size()));
+        for (auto &s: *chunk) {
+            s.fold = (*count)++ % F;
+            ++fold_sizes[s.fold];
+            os << s.fold << '\t' << s.url << '\t' << s.anno << '\t' << s.weight << '\n';
+        }
+        CHECK(os) << "failed to write chunk";
+        chunk_sizes.push_back(chunk->size());
+        chunk->clear();
+    }
 public:
-    Annotation () {}
-    Annotation (string const &txt) {
-        string err;
-        Json json = Json::parse(txt, err);
-        if (err.size()) {
-            LOG(ERROR) << "Bad json: " << err << " (" << txt << ")";
-            return;
+    ChunkedList (string const &path, unsigned F, size_t chunk, fs::path const &tmp)
+        : dir(fs::unique_path(tmp / fs::path("caffex-import-%%%%-%%%%"))), total_remain(0) {
+        CHECK(chunk >= 1);
+        CHECK(fs::create_directories(dir));
+        fold_sizes.resize(F, 0);
+        vector<Sample> buf;
+        buf.reserve(chunk);
+        size_t count = 0;
+        Sample s;
+        ifstream is(path.c_str());
+        string line;
+        while (getline(is, line)) {
+            if (!ParseLine(line, &s)) {
+                cerr << "Bad line: " << line << endl;
+                continue;
+            }
+            buf.push_back(s);
+            if (buf.size() >= chunk) {
+                dump(&buf, F, &count);
+            }
+        }
+        if (buf.size()) {
+            dump(&buf, F, &count);
         }
-        for (auto const &x: json["shapes"].array_items()) {
-            shapes.emplace_back(Shape::create(x));
+        LOG(INFO) << "Loaded " << count << " samples into " << chunk_sizes.size() << " chunks." << endl;
+    }
+    ~ChunkedList () {
+        streams.clear();
+        fs::remove_all(dir);
+    }
+    virtual void rewind (bool) {
+        // the interleaving is random anyway
+        streams.clear();
+        remain = chunk_sizes;
+        total_remain = 0;
+        for (unsigned c = 0; c < chunk_sizes.size(); ++c) {
+            streams.emplace_back(new ifstream(chunk_path(c).c_str()));
+            total_remain += remain[c];
         }
     }
-
-    void draw (cv::Mat *m, cv::Scalar v, int thickness = -1) const {
-        for (auto const &p: shapes) {
-            p->draw(m, v, thickness);
+    virtual bool read (Sample *s) {
+        if (total_remain == 0) return false;
+        size_t r = std::uniform_int_distribution<size_t>(0, total_remain - 1)(e);
+        unsigned c = 0;
+        while (r >= remain[c]) {
+            r -= remain[c];
+            ++c;
         }
+        --remain[c];
+        --total_remain;
+        string line;
+        CHECK(getline(*streams[c], line)) << "truncated chunk " << chunk_path(c);
+        size_t tab = line.find('\t');
+        CHECK(tab != string::npos);
+        s->fold = lexical_cast<unsigned>(line.substr(0, tab));
+        CHECK(ParseLine(line.substr(tab + 1), s));
+        return true;
     }
 };
 
-
-struct Sample {
-    string url;
-    Annotation anno;
+// One pass over a list, restricted to (or excluding) one fold.
+class SampleStream {
+    SampleList *list;
+    int fold;       // -1 for all folds
+    bool exclude;
+public:
+    SampleStream (SampleList *list_, int fold_ = -1, bool exclude_ = false)
+        : list(list_), fold(fold_), exclude(exclude_) {
+    }
+    size_t size () const {
+        size_t total = 0;
+        for (size_t v: list->fold_sizes) total += v;
+        if (fold < 0) return total;
+        if (exclude) return total - list->fold_sizes[fold];
+        return list->fold_sizes[fold];
+    }
+    void rewind (bool shuffle) {
+        list->rewind(shuffle);
+    }
+    bool next (Sample *s) {
+        while (list->read(s)) {
+            if ((fold < 0) || ((int(s->fold) == fold) != exclude)) return true;
+        }
+        return false;
+    }
 };
 
 bool gray = false;
 
-bool IsURL (std::string const &url) {
-    if (url.compare(0, 7, "http://") == 0) return true;
-    if (url.compare(0, 8, "https://") == 0) return true;
-    if (url.compare(0, 6, "ftp://") == 0) return true;
-    return false;
-}   
-
 string download_agent;
 int download_timeout = 5;
-fs::path temp_dir("/tmp");
-
-fs::path temp_path (const fs::path& model="%%%%-%%%%-%%%%-%%%%") {
-    return fs::unique_path(temp_dir / model);
-}
-
+int download_threads = 16;
+int download_retries = 3;
 fs::path cache_dir;
-void Checksum (void const *data, unsigned length, std::string *checksum);
-
-fs::path cache_path (const std::string &url) {
-    string sum;
-    Checksum(&url[0], url.size(), &sum);
-    return cache_dir / fs::path(sum);
-}
-
-fs::path Download (const std::string &url) {
-    fs::path path = cache_path(url);
-    if (fs::exists(path)) {
-        return path;
-    }
-    int timeout = download_timeout;
-    if (timeout <= 0) {
-        timeout = 5;
-    }
-    ostringstream ss;
-    ss << "wget --output-document=" << path.native() << " --tries=1 -nv --no-check-certificate";
-    ss << " --quiet --timeout=" << timeout;
-    if (download_agent.size()) {
-        ss << " --user-agent=" << download_agent;
-    }
-    ss << ' ' << '"' << url << '"';
-    string cmd = ss.str();
-    LOG(INFO) << cmd;
-    ::system(cmd.c_str()) == 0;
-    return path;
-}
+unsigned cache_size = 0;    // MB
+unsigned failure_ttl = 86400;
+std::unique_ptr<caffex::Downloader> downloader;
 
 int max_size = 600;
 
@@ -191,9 +264,10 @@ void LimitSize (cv::Mat input, cv::Mat *output) {
 
 cv::Mat imreadx (string const &url) {
     cv::Mat v;
-    if (IsURL(url)) {
-        fs::path path = Download(url);
+    if (caffex::IsURL(url)) {
+        fs::path path = downloader->fetch(url);
         v = cv::imread(path.native(), -1);
+        downloader->release(url);
         if (!v.data) {
             LOG(ERROR) << "Failed to download " << url;
         }
@@ -235,6 +309,7 @@ class Sampler {
     std::uniform_real_distribution<float> linear_angle;
     std::uniform_real_distribution<float> linear_scale;
     std::default_random_engine e;
+    std::default_random_engine crop_e;  // separate, so e draws as without --crop
 public:
     Sampler ()
         : /* max_color(config.get<float>("adsb2.aug.color", 20)), */
@@ -248,6 +323,7 @@ public:
         cv::Scalar color;
         float angle, scale;
         bool flip;
+        unsigned seed;  // for crop placement
     };
 
     void sample (Delta *p) {
@@ -258,6 +334,7 @@ public:
         p->color[3] = delta_color(e);
         p->angle = linear_angle(e);
         p->scale = std::exp(linear_scale(e));
+        p->seed = crop_e();
     }
 
     void linear (cv::Mat from_image,
@@ -283,93 +360,174 @@ public:
     }
 };
 
+int crop_size = 0;
+int crops_per_sample = 1;
+float crop_fg = 0.5;
+
+// pixel (x, y) of the k-th nonzero label pixel in raster order
+static cv::Point NthNonZero (cv::Mat const &label, int k) {
+    for (int y = 0; y < label.rows; ++y) {
+        uint8_t const *row = label.ptr<uint8_t>(y);
+        for (int x = 0; x < label.cols; ++x) {
+            if (row[x] && (k-- == 0)) return cv::Point(x, y);
+        }
+    }
+    return cv::Point(0, 0);
+}
+
+// Cuts crops_per_sample crop_size x crop_size patches out of image/label,
+// so all samples have the same shape and can be trained in batches.
+// With probability crop_fg a patch is centered on a random foreground
+// pixel, otherwise it is placed uniformly.  Small images are zero-padded.
+void Crop (cv::Mat image, cv::Mat label, unsigned seed,
+           vector<cv::Mat> *images, vector<cv::Mat> *labels) {
+    int dy = std::max(0, crop_size - image.rows);
+    int dx = std::max(0, crop_size - image.cols);
+    if (dx || dy) {
+        cv::copyMakeBorder(image, image, dy/2, dy - dy/2, dx/2, dx - dx/2, cv::BORDER_CONSTANT, cv::Scalar(0, 0, 0));
+        cv::copyMakeBorder(label, label, dy/2, dy - dy/2, dx/2, dx - dx/2, cv::BORDER_CONSTANT, cv::Scalar(0));
+    }
+    std::default_random_engine e(seed);
+    std::uniform_real_distribution<float> coin(0, 1);
+    std::uniform_int_distribution<int> xr(0, image.cols - crop_size);
+    std::uniform_int_distribution<int> yr(0, image.rows - crop_size);
+    int fg = (crop_fg > 0) ? cv::countNonZero(label) : 0;
+    for (int i = 0; i < crops_per_sample; ++i) {
+        cv::Rect roi(xr(e), yr(e), crop_size, crop_size);
+        if (fg && (coin(e) < crop_fg)) {
+            cv::Point c = NthNonZero(label, std::uniform_int_distribution<int>(0, fg - 1)(e));
+            roi.x = std::min(std::max(0, c.x - crop_size / 2), image.cols - crop_size);
+            roi.y = std::min(std::max(0, c.y - crop_size / 2), image.rows - crop_size);
+        }
+        images->push_back(image(roi));
+        labels->push_back(label(roi));
+    }
+}
+
 int replicate = 1;
-void import (vector<Sample> const &samples, fs::path const &dir, bool test_set = false) {
+unsigned import_batch = 64;
+unsigned prefetch = 512;
+void import (SampleStream &stream, fs::path const &dir, bool test_set = false) {
     CHECK(fs::create_directories(dir));
     fs::path image_path = dir / fs::path("images");
     fs::path label_path = dir / fs::path("labels");
     fs::path sample_path = dir / fs::path("samples");
   // Create new DB
-    scoped_ptr<db::DB> image_db(db::GetDB(backend));
+    scoped_ptr<db::DB> image_db(caffex::GetDB(backend));
     image_db->Open(image_path.string(), db::NEW);
     scoped_ptr<db::Transaction> image_txn(image_db->NewTransaction());
 
-    scoped_ptr<db::DB> label_db(db::GetDB(backend));
+    scoped_ptr<db::DB> label_db(caffex::GetDB(backend));
     label_db->Open(label_path.string(), db::NEW);
     scoped_ptr<db::Transaction> label_txn(label_db->NewTransaction());
 
     Sampler sampler;
     int count = 0;
-    vector<unsigned> index(samples.size());
-    for (unsigned i = 0; i < index.size(); ++i) {
-        index[i] = i;
-    }
     int n_rep = test_set ? 1 : replicate;
 
-    progress_display progress(n_rep * index.size(),cerr);
+    progress_display progress(n_rep * stream.size(),cerr);
     for (int rep = 0; rep < n_rep; ++rep) {
-        if (rep > 0) {
-            random_shuffle(index.begin(), index.end());
-        }
-//#pragma omp parallel for
-        for (unsigned iid = 0; iid < index.size(); ++iid) {
-            auto const &sample = samples[index[iid]];
-            cv::Mat raw_image;
-            Sampler::Delta delta;
-            int ccount;
-//#pragma omp critical
-            {
-                ccount = count++;
-                raw_image = imreadx(sample.url);
-                sampler.sample(&delta);
-                ++progress;
+        stream.rewind(rep > 0);
+        // samples read ahead, downloads run ahead of the decoding
+        // threads by up to `prefetch` samples
+        std::deque<Sample> ahead;
+        bool more = true;
+        while (more || ahead.size()) {
+            while (more && (ahead.size() < import_batch + prefetch)) {
+                Sample s;
+                more = stream.next(&s);
+                if (!more) break;
+                // weight 0 samples are never fetched, a prefetch would pin them
+                bool used = test_set || (s.weight > 0);
+                if (used && caffex::IsURL(s.url)) downloader->prefetch(s.url);
+                ahead.push_back(std::move(s));
             }
-            if (!raw_image.data) {
-                LOG(ERROR) << "fail to load url: " << sample.url;
-                continue;
+            unsigned n = std::min<unsigned>(import_batch, ahead.size());
+            vector<Sample> batch(std::make_move_iterator(ahead.begin()),
+                                 std::make_move_iterator(ahead.begin() + n));
+            ahead.erase(ahead.begin(), ahead.begin() + n);
+            // a training sample is written weight times per pass,
+            // the extra copies augmented
+            vector<unsigned> first(n + 1, 0);
+            for (unsigned i = 0; i < n; ++i) {
+                first[i + 1] = first[i] + (test_set ? 1 : batch[i].weight);
             }
-            Datum datum;
-            string key = lexical_cast<string>(ccount), ivalue, lvalue;
-            cv::Mat raw_label(raw_image.size(), CV_8UC1, cv::Scalar(0));
-            sample.anno.draw(&raw_label, cv::Scalar(1));
-            cv::Mat image, label;
-            if (rep == 0) {
-                image = raw_image;
-                label = raw_label;
+            vector<Sampler::Delta> deltas(first[n]);
+            for (auto &delta: deltas) {
+                sampler.sample(&delta);
             }
-            else {
-                sampler.linear(raw_image, raw_label, &image, &label, delta);
+            vector<vector<string>> ivalues(n), lvalues(n);
+#pragma omp parallel for schedule(dynamic, 1)
+            for (unsigned i = 0; i < n; ++i) {
+                auto const &sample = batch[i];
+                if (first[i] == first[i + 1]) continue;     // weight 0
+                cv::Mat raw_image = imreadx(sample.url);
+                if (!raw_image.data) {
+                    LOG(ERROR) << "fail to load url: " << sample.url;
+                    continue;
+                }
+                Datum datum;
+                cv::Mat raw_label(raw_image.size(), CV_8UC1, cv::Scalar(0));
+                caffex::Annotation(sample.anno).rasterize(&raw_label, 1);
+                vector<cv::Mat> images, labels;
+                for (unsigned k = first[i]; k < first[i + 1]; ++k) {
+                    cv::Mat image, label;
+                    if ((rep == 0) && (k == first[i])) {
+                        image = raw_image;
+                        label = raw_label;
+                    }
+                    else {
+                        sampler.linear(raw_image, raw_label, &image, &label, deltas[k]);
+                    }
+                    if ((crop_size > 0) && !test_set) {
+                        Crop(image, label, deltas[k].seed, &images, &labels);
+                    }
+                    else {
+                        images.push_back(image);
+                        labels.push_back(label);
+                    }
+                }
+                ivalues[i].resize(images.size());
+                lvalues[i].resize(images.size());
+                for (unsigned j = 0; j < images.size(); ++j) {
+                    caffe::CVMatToDatum(images[j], &datum);
+                    datum.set_label(0);
+                    CHECK(datum.SerializeToString(&ivalues[i][j]));
+
+                    caffe::CVMatToDatum(labels[j], &datum);
+                    datum.set_label(0);
+                    CHECK(datum.SerializeToString(&lvalues[i][j]));
+                }
             }
-
-            caffe::CVMatToDatum(image, &datum);
-            datum.set_label(0);
-            CHECK(datum.SerializeToString(&ivalue));
-
-            caffe::CVMatToDatum(label, &datum);
-            datum.set_label(0);
-            CHECK(datum.SerializeToString(&lvalue));
-//#pragma omp critical
-            {
-                image_txn->Put(key, ivalue);
-                label_txn->Put(key, lvalue);
-
-                if (ccount % 1000 == 0) {
-                    // Commit db
-                    image_txn->Commit();
-                    image_txn.reset(image_db->NewTransaction());
-                    label_txn->Commit();
-                    label_txn.reset(label_db->NewTransaction());
+            // write in order, so the db does not depend on thread scheduling
+            for (unsigned i = 0; i < n; ++i) {
+                for (unsigned j = 0; j < ivalues[i].size(); ++j) {
+                    int ccount = count++;
+                    string key = lexical_cast<string>(ccount);
+                    image_txn->Put(key, ivalues[i][j]);
+                    label_txn->Put(key, lvalues[i][j]);
+
+                    if (ccount % 1000 == 0) {
+                        // Commit db
+                        image_txn->Commit();
+                        image_txn.reset(image_db->NewTransaction());
+                        label_txn->Commit();
+                        label_txn.reset(label_db->NewTransaction());
+                    }
                 }
             }
+            progress += n;
         }
     }
     image_txn->Commit();
     label_txn->Commit();
 }
 
-void save_list (vector<Sample> const &samples, fs::path path) {
+void save_list (SampleStream &stream, fs::path path) {
     fs::ofstream os(path);
-    for (auto const &s: samples) {
+    Sample s;
+    stream.rewind(false);
+    while (stream.next(&s)) {
         os << s.url << endl;
     }
 }
@@ -381,6 +539,8 @@ int main(int argc, char **argv) {
     string output_dir;
     bool full = false;
     int F;
+    size_t chunk;
+    fs::path temp_dir;
 
     po::options_description desc("Allowed options");
     desc.add_options()
@@ -393,13 +553,26 @@ int main(int argc, char **argv) {
     ("output,o", po::value(&output_dir), "")
     ("timeout", po::value(&download_timeout)->default_value(5), "")
     ("agent", po::value(&download_agent), "")
+    ("download-threads", po::value(&download_threads)->default_value(download_threads), "concurrent downloads")
+    ("retries", po::value(&download_retries)->default_value(download_retries), "")
+    ("prefetch", po::value(&prefetch)->default_value(prefetch), "number of samples to download ahead")
+    ("batch", po::value(&import_batch)->default_value(import_batch), "number of samples decoded in parallel")
     ("replicate,R", po::value(&replicate)->default_value(1), "")
     ("sangle", po::value(&sampler_angle)->default_value(sampler_angle), "")
     ("sscale", po::value(&sampler_scale)->default_value(sampler_scale), "")
     ("scolor", po::value(&sampler_color)->default_value(sampler_color), "")
     ("max", po::value(&max_size)->default_value(max_size), "")
+    ("crop", po::value(&crop_size)->default_value(crop_size), "emit fixed-size training crops of this size, 0 for whole images")
+    ("crops", po::value(&crops_per_sample)->default_value(crops_per_sample), "crops per training sample and pass")
+    ("crop-fg", po::value(&crop_fg)->default_value(crop_fg), "fraction of crops centered on foreground")
     ("log-level,v", po::value(&FLAGS_minloglevel)->default_value(1), "")
     ("cache", po::value(&cache_dir)->default_value(".caffex_cache"), "")
+    ("cache-size", po::value(&cache_size)->default_value(cache_size), "cache budget in MB, 0 for unlimited")
+    ("failure-ttl", po::value(&failure_ttl)->default_value(failure_ttl), "seconds before retrying a failed URL")
+    ("backend", po::value(&backend)->default_value(backend), "lmdb, leveldb or shard")
+    ("stream", "stream the list through an external shuffle instead of loading it")
+    ("chunk", po::value(&chunk)->default_value(1000000), "lines per shuffle chunk with --stream")
+    ("tmp", po::value(&temp_dir)->default_value("/tmp"), "")
     ;
 
     po::positional_options_description p;
@@ -416,55 +589,41 @@ int main(int argc, char **argv) {
         return 1;
     }
     CHECK(F >= 1);
+    CHECK(crops_per_sample >= 1);
     full = vm.count("full") > 0;
     if (vm.count("gray")) gray = true;
 
     google::InitGoogleLogging(argv[0]);
-    fs::create_directories(cache_dir);
-    vector<Sample> samples;
+    CHECK(import_batch >= 1);
     {
-        Sample s;
-        ifstream is(list_path.c_str());
-        string line;
-        while (getline(is, line)) {
-            vector<string> ss;
-            split(ss, line, is_any_of("\t"), token_compress_off);
-            if (ss.size() != 2) {
-                cerr << "Bad line: " << line << endl;
-                continue;
-            }
-            s.url = ss[0];
-            s.anno = Annotation(ss[1]);
-            /*
-            if (!fs::is_regular_file(fs::path(root_dir + path))) {
-                LOG(ERROR) << "Cannot find regular file: " << path;
-                continue;
-            }
-            */
-            samples.push_back(s);
-        }
-        LOG(INFO) << "Loaded " << samples.size() << " samples." << endl;
+        caffex::Downloader::Config config;
+        config.cache_dir = cache_dir;
+        config.agent = download_agent;
+        config.threads = download_threads;
+        config.timeout = download_timeout;
+        config.retries = download_retries;
+        config.cache_size = uint64_t(cache_size) << 20;
+        config.failure_ttl = failure_ttl;
+        downloader.reset(new caffex::Downloader(config));
+    }
+    std::unique_ptr<SampleList> list;
+    if (vm.count("stream")) {
+        list.reset(new ChunkedList(list_path, F, chunk, temp_dir));
+    }
+    else {
+        list.reset(new MemoryList(list_path, F));
     }
 
     if (F == 1) {
-        import(samples, fs::path(output_dir));
+        SampleStream all(list.get());
+        import(all, fs::path(output_dir));
         return 0;
     }
     // N-fold cross validation
-    vector<vector<Sample>> folds(F);
-    random_shuffle(samples.begin(), samples.end());
-    for (unsigned i = 0; i < samples.size(); ++i) {
-        folds[i % F].push_back(samples[i]);
-    }
-
     for (unsigned f = 0; f < F; ++f) {
-        vector<Sample> const &val = folds[f];
-        // collect training examples
-        vector<Sample> train;
-        for (unsigned i = 0; i < F; ++i) {
-            if (i == f) continue;
-            train.insert(train.end(), folds[i].begin(), folds[i].end());
-        }
+        SampleStream val(list.get(), f);
+        // training examples are all the other folds
+        SampleStream train(list.get(), f, true);
         fs::path fold_path(output_dir);
         if (full) {
             fold_path /= lexical_cast<string>(f);
@@ -479,216 +638,3 @@ int main(int argc, char **argv) {
 
     return 0;
 }
-
-namespace from_boost_uuid_detail {
-
-BOOST_STATIC_ASSERT(sizeof(unsigned char)*8 == 8);
-BOOST_STATIC_ASSERT(sizeof(unsigned int)*8 == 32);
-
-inline unsigned int left_rotate(unsigned int x, std::size_t n)
-{
-    return (x<<n) ^ (x>> (32-n));
-}
-
-class sha1
-{
-public:
-    typedef unsigned int(&digest_type)[5];
-public:
-    sha1();
-
-    void reset();
-
-    void process_byte(unsigned char byte);
-    void process_block(void const* bytes_begin, void const* bytes_end);
-    void process_bytes(void const* buffer, std::size_t byte_count);
-
-    void get_digest(digest_type digest);
-
-private:
-    void process_block();
-    void process_byte_impl(unsigned char byte);
-
-private:
-    unsigned int h_[5];
-
-    unsigned char block_[64];
-
-    std::size_t block_byte_index_;
-    std::size_t bit_count_low;
-    std::size_t bit_count_high;
-};
-
-inline sha1::sha1()
-{
-    reset();
-}
-
-inline void sha1::reset()
-{
-    h_[0] = 0x67452301;
-    h_[1] = 0xEFCDAB89;
-    h_[2] = 0x98BADCFE;
-    h_[3] = 0x10325476;
-    h_[4] = 0xC3D2E1F0;
-
-    block_byte_index_ = 0;
-    bit_count_low = 0;
-    bit_count_high = 0;
-}
-
-inline void sha1::process_byte(unsigned char byte)
-{
-    process_byte_impl(byte);
-
-    if (bit_count_low < 0xFFFFFFF8) {
-        bit_count_low += 8;
-    } else {
-        bit_count_low = 0;
-
-        if (bit_count_high <= 0xFFFFFFFE) {
-            ++bit_count_high;
-        } else {
-            BOOST_THROW_EXCEPTION(std::runtime_error("sha1 too many bytes"));
-        }
-    }
-}
-
-inline void sha1::process_byte_impl(unsigned char byte)
-{
-    block_[block_byte_index_++] = byte;
-
-    if (block_byte_index_ == 64) {
-        block_byte_index_ = 0;
-        process_block();
-    }
-}
-
-inline void sha1::process_block(void const* bytes_begin, void const* bytes_end)
-{
-    unsigned char const* begin = static_cast<unsigned char const*>(bytes_begin);
-    unsigned char const* end = static_cast<unsigned char const*>(bytes_end);
-    for(; begin != end; ++begin) {
-        process_byte(*begin);
-    }
-}
-
-inline void sha1::process_bytes(void const* buffer, std::size_t byte_count)
-{
-    unsigned char const* b = static_cast<unsigned char const*>(buffer);
-    process_block(b, b+byte_count);
-}
-
-inline void sha1::process_block()
-{
-    unsigned int w[80];
-    for (std::size_t i=0; i<16; ++i) {
-        w[i]  = (block_[i*4 + 0] << 24);
-        w[i] |= (block_[i*4 + 1] << 16);
-        w[i] |= (block_[i*4 + 2] << 8);
-        w[i] |= (block_[i*4 + 3]);
-    }
-    for (std::size_t i=16; i<80; ++i) {
-        w[i] = left_rotate((w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16]), 1);
-    }
-
-    unsigned int a = h_[0];
-    unsigned int b = h_[1];
-    unsigned int c = h_[2];
-    unsigned int d = h_[3];
-    unsigned int e = h_[4];
-
-    for (std::size_t i=0; i<80; ++i) {
-        unsigned int f;
-        unsigned int k;
-
-        if (i<20) {
-            f = (b & c) | (~b & d);
-            k = 0x5A827999;
-        } else if (i<40) {
-            f = b ^ c ^ d;
-            k = 0x6ED9EBA1;
-        } else if (i<60) {
-            f = (b & c) | (b & d) | (c & d);
-            k = 0x8F1BBCDC;
-        } else {
-            f = b ^ c ^ d;
-            k = 0xCA62C1D6;
-        }
-
-        unsigned temp = left_rotate(a, 5) + f + e + k + w[i];
-        e = d;
-        d = c;
-        c = left_rotate(b, 30);
-        b = a;
-        a = temp;
-    }
-
-    h_[0] += a;
-    h_[1] += b;
-    h_[2] += c;
-    h_[3] += d;
-    h_[4] += e;
-}
-
-inline void sha1::get_digest(digest_type digest)
-{
-    // append the bit '1' to the message
-    process_byte_impl(0x80);
-
-    // append k bits '0', where k is the minimum number >= 0
-    // such that the resulting message length is congruent to 56 (mod 64)
-    // check if there is enough space for padding and bit_count
-    if (block_byte_index_ > 56) {
-        // finish this block
-        while (block_byte_index_ != 0) {
-            process_byte_impl(0);
-        }
-
-        // one more block
-        while (block_byte_index_ < 56) {
-            process_byte_impl(0);
-        }
-    } else {
-        while (block_byte_index_ < 56) {
-            process_byte_impl(0);
-        }
-    }
-
-    // append length of message (before pre-processing) 
-    // as a 64-bit big-endian integer
-    process_byte_impl( static_cast<unsigned char>((bit_count_high>>24) & 0xFF) );
-    process_byte_impl( static_cast<unsigned char>((bit_count_high>>16) & 0xFF) );
-    process_byte_impl( static_cast<unsigned char>((bit_count_high>>8 ) & 0xFF) );
-    process_byte_impl( static_cast<unsigned char>((bit_count_high)     & 0xFF) );
-    process_byte_impl( static_cast<unsigned char>((bit_count_low>>24) & 0xFF) );
-    process_byte_impl( static_cast<unsigned char>((bit_count_low>>16) & 0xFF) );
-    process_byte_impl( static_cast<unsigned char>((bit_count_low>>8 ) & 0xFF) );
-    process_byte_impl( static_cast<unsigned char>((bit_count_low)     & 0xFF) );
-
-    // get final digest
-    digest[0] = h_[0];
-    digest[1] = h_[1];
-    digest[2] = h_[2];
-    digest[3] = h_[3];
-    digest[4] = h_[4];
-}
-}
-void Checksum (void const *data, unsigned length, std::string *checksum) {
-        uint32_t digest[5];
-        from_boost_uuid_detail::sha1 sha1;
-        sha1.process_block(data, data+length);
-        sha1.get_digest(digest);
-        static char const digits[] = "0123456789abcdef";
-        checksum->clear();
-        for(uint32_t c: digest) {
-            checksum->push_back(digits[(c >> 28) & 0xF]);
-            checksum->push_back(digits[(c >> 24) & 0xF]);
-            checksum->push_back(digits[(c >> 20) & 0xF]);
-            checksum->push_back(digits[(c >> 16) & 0xF]);
-            checksum->push_back(digits[(c >> 12) & 0xF]);
-            checksum->push_back(digits[(c >> 8) & 0xF]);
-            checksum->push_back(digits[(c >> 4) & 0xF]);
-            checksum->push_back(digits[c & 0xF]);
-        }
-    }
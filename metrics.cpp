@@ -0,0 +1,196 @@
+#include <cstdio>
+#include <fstream>
+#include <glog/logging.h>
+#include "metrics.h"
+
+namespace caffex {
+
+constexpr unsigned Histogram::BUCKETS;
+
+Metrics &Metrics::global () {
+    static Metrics metrics;
+    return metrics;
+}
+
+Metrics::Entry &Metrics::entry (string const &name, string const &help) {
+    Entry &e = entries[name];
+    if (e.help.empty()) e.help = help;
+    return e;
+}
+
+Counter &Metrics::counter (string const &name, string const &help) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Entry &e = entry(name, help);
+    CHECK(!e.gauge && !e.histogram) << name << " is not a counter";
+    if (!e.counter) e.counter.reset(new Counter);
+    return *e.counter;
+}
+
+Gauge &Metrics::gauge (string const &name, string const &help) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Entry &e = entry(name, help);
+    CHECK(!e.counter && !e.histogram) << name << " is not a gauge";
+    if (!e.gauge) e.gauge.reset(new Gauge);
+    return *e.gauge;
+}
+
+Histogram &Metrics::histogram (string const &name, string const &help) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Entry &e = entry(name, help);
+    CHECK(!e.counter && !e.gauge) << name << " is not a histogram";
+    if (!e.histogram) e.histogram.reset(new Histogram);
+    return *e.histogram;
+}
+
+void Metrics::counters (std::map<string, uint64_t> *values) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    values->clear();
+    for (auto const &p: entries) {
+        if (p.second.counter) (*values)[p.first] = p.second.counter->get();
+    }
+}
+
+void Metrics::render (std::ostream &os, std::map<string, double> const *rate) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto const &p: entries) {
+        string const &name = p.first;
+        Entry const &e = p.second;
+        if (e.help.size()) {
+            os << "# HELP " << name << ' ' << e.help << '\n';
+        }
+        if (e.counter) {
+            os << "# TYPE " << name << " counter\n";
+            os << name << ' ' << e.counter->get() << '\n';
+            if (rate) {
+                auto it = rate->find(name);
+                if (it != rate->end()) {
+                    os << "# TYPE " << name << "_per_second gauge\n";
+                    os << name << "_per_second " << it->second << '\n';
+                }
+            }
+        }
+        else if (e.gauge) {
+            os << "# TYPE " << name << " gauge\n";
+            os << name << ' ' << e.gauge->get() << '\n';
+        }
+        else if (e.histogram) {
+            // latencies are exported in seconds
+            Histogram const &h = *e.histogram;
+            os << "# TYPE " << name << " histogram\n";
+            uint64_t total = 0;
+            for (unsigned i = 0; i < Histogram::BUCKETS; ++i) {
+                total += h.buckets[i].load(std::memory_order_relaxed);
+                if (i + 1 < Histogram::BUCKETS) {
+                    os << name << "_bucket{le=\"" << double(uint64_t(1) << i) / 1e6 << "\"} " << total << '\n';
+                }
+            }
+            os << name << "_bucket{le=\"+Inf\"} " << total << '\n';
+            os << name << "_sum " << h.sum.load(std::memory_order_relaxed) / 1e6 << '\n';
+            os << name << "_count " << total << '\n';
+        }
+    }
+}
+
+StatsWriter::StatsWriter (Metrics &m, string const &path_, double interval_)
+    : metrics(m), path(path_), interval(interval_), stop(false) {
+    CHECK(interval > 0);
+    thread = std::thread([this]() { run(); });
+}
+
+StatsWriter::~StatsWriter () {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    cv.notify_all();
+    thread.join();
+}
+
+void StatsWriter::write (std::map<string, double> const &rate) {
+    string tmp = path + ".tmp";
+    {
+        std::ofstream os(tmp.c_str());
+        if (!os) {
+            LOG(ERROR) << "cannot write " << tmp;
+            return;
+        }
+        metrics.render(os, &rate);
+    }
+    if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+        PLOG(ERROR) << "cannot rename " << tmp;
+    }
+}
+
+void StatsWriter::run () {
+    typedef std::chrono::steady_clock clock;
+    std::map<string, uint64_t> last, cur;
+    std::map<string, double> rate;
+    metrics.counters(&last);
+    auto last_time = clock::now();
+    for (;;) {
+        bool done;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait_for(lock, std::chrono::duration<double>(interval), [this]() { return stop; });
+            done = stop;
+        }
+        auto now = clock::now();
+        double elapsed = std::chrono::duration<double>(now - last_time).count();
+        metrics.counters(&cur);
+        rate.clear();
+        for (auto const &p: cur) {
+            uint64_t before = last.count(p.first) ? last[p.first] : 0;
+            rate[p.first] = elapsed > 0 ? (p.second - before) / elapsed : 0;
+        }
+        write(rate);
+        last.swap(cur);
+        last_time = now;
+        if (done) break;
+    }
+}
+
+ImageMetrics::ImageMetrics (Metrics &m)
+    : decode_time(m.histogram("caffex_decode_seconds", "time to load and decode an image")),
+    output_time(m.histogram("caffex_output_seconds", "time to write the results")),
+    images(m.counter("caffex_images_total", "images processed")),
+    failures(m.counter("caffex_failures_total", "images that failed to load")) {
+}
+
+Progress::Progress (uint64_t total_, std::initializer_list<Counter const *> counters_, std::ostream &os_)
+    : counters(counters_), total(total_), base(0), os(os_), stop(false) {
+    base = done();
+    thread = std::thread([this]() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!cv.wait_for(lock, std::chrono::seconds(1), [this]() { return stop; })) {
+            print();
+        }
+    });
+}
+
+Progress::~Progress () {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    cv.notify_all();
+    thread.join();
+    print();
+    os << std::endl;
+}
+
+uint64_t Progress::done () const {
+    uint64_t v = 0;
+    for (auto c: counters) {
+        v += c->get();
+    }
+    return v;
+}
+
+void Progress::print () {
+    uint64_t n = done() - base;
+    os << '\r' << n << '/' << total;
+    if (total) os << " (" << n * 100 / total << "%)";
+    os.flush();
+}
+
+}
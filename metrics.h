@@ -0,0 +1,154 @@
+#pragma once
+#include <string>
+#include <map>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <ostream>
+#include <iostream>
+
+namespace caffex {
+
+using std::string;
+
+// Lock-free metrics updated from the worker threads and rendered in
+// the Prometheus text format.  Only registration takes a lock, so
+// look a metric up once and keep the reference.
+
+class Counter {
+    std::atomic<uint64_t> value;
+public:
+    Counter (): value(0) {
+    }
+    void add (uint64_t n = 1) {
+        value.fetch_add(n, std::memory_order_relaxed);
+    }
+    uint64_t get () const {
+        return value.load(std::memory_order_relaxed);
+    }
+};
+
+class Gauge {
+    std::atomic<int64_t> value;
+public:
+    Gauge (): value(0) {
+    }
+    void set (int64_t v) {
+        value.store(v, std::memory_order_relaxed);
+    }
+    void add (int64_t n) {
+        value.fetch_add(n, std::memory_order_relaxed);
+    }
+    int64_t get () const {
+        return value.load(std::memory_order_relaxed);
+    }
+};
+
+// Latency histogram with power of 2 buckets in microseconds,
+// bucket i counts observations below 2^i us.
+class Histogram {
+public:
+    static constexpr unsigned BUCKETS = 32;     // up to about 36 minutes
+private:
+    std::atomic<uint64_t> buckets[BUCKETS];
+    std::atomic<uint64_t> sum;                  // us
+    friend class Metrics;
+public:
+    Histogram (): sum(0) {
+        for (auto &b: buckets) b.store(0);
+    }
+    void observe (uint64_t us) {
+        unsigned i = 0;
+        while ((i + 1 < BUCKETS) && (us >= (uint64_t(1) << i))) ++i;
+        buckets[i].fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(us, std::memory_order_relaxed);
+    }
+};
+
+// Adds the lifetime of the object to a histogram.
+class Timer {
+    Histogram &histogram;
+    std::chrono::steady_clock::time_point start;
+public:
+    Timer (Histogram &h): histogram(h), start(std::chrono::steady_clock::now()) {
+    }
+    ~Timer () {
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+        histogram.observe(us);
+    }
+};
+
+class Metrics {
+    struct Entry {
+        string help;
+        std::unique_ptr<Counter> counter;
+        std::unique_ptr<Gauge> gauge;
+        std::unique_ptr<Histogram> histogram;
+    };
+    mutable std::mutex mutex;
+    std::map<string, Entry> entries;
+    Entry &entry (string const &name, string const &help);
+public:
+    // the process-wide instance used by Caffex and the tools
+    static Metrics &global ();
+    Counter &counter (string const &name, string const &help = "");
+    Gauge &gauge (string const &name, string const &help = "");
+    Histogram &histogram (string const &name, string const &help = "");
+    // counters also get a <name>_per_second gauge when rate is given
+    void render (std::ostream &os, std::map<string, double> const *rate = nullptr) const;
+    void counters (std::map<string, uint64_t> *values) const;
+};
+
+// Rewrites a stats file every interval seconds, through a temporary
+// file and a rename so readers never see a partial file.  The format
+// is what the Prometheus node exporter's textfile collector reads.
+class StatsWriter {
+    Metrics &metrics;
+    string path;
+    double interval;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stop;
+    std::thread thread;
+    void write (std::map<string, double> const &rate);
+    void run ();
+public:
+    StatsWriter (Metrics &m, string const &path, double interval);
+    // writes a final snapshot
+    ~StatsWriter ();
+};
+
+// The metrics shared by the image tools, so they are registered with
+// the same names and help everywhere.
+struct ImageMetrics {
+    Histogram &decode_time;
+    Histogram &output_time;
+    Counter &images;
+    Counter &failures;
+    ImageMetrics (Metrics &m = Metrics::global());
+};
+
+// Prints the progress of counters towards total to a stream once a
+// second from its own thread, so workers only do lock-free counter adds.
+class Progress {
+    std::vector<Counter const *> counters;
+    uint64_t total;
+    uint64_t base;
+    std::ostream &os;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stop;
+    std::thread thread;
+    uint64_t done () const;
+    void print ();
+public:
+    Progress (uint64_t total, std::initializer_list<Counter const *> counters, std::ostream &os = std::cerr);
+    // prints the final count
+    ~Progress ();
+};
+
+}
@@ -0,0 +1,138 @@
+#include <glog/logging.h>
+#include "registry.h"
+#include "metrics.h"
+
+namespace caffex {
+
+ModelRegistry::ModelRegistry (Config const &config_)
+    : config(config_), total(0), stop(false) {
+    if (config.batch < 1) config.batch = 1;
+    for (unsigned i = 0; i < config.threads; ++i) {
+        workers.emplace_back([this]() { worker(); });
+    }
+}
+
+ModelRegistry::~ModelRegistry () {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    queue_cv.notify_all();
+    for (auto &th: workers) {
+        th.join();
+    }
+}
+
+// Returns the shared load of model_dir; the first caller for a model
+// does the loading, later callers wait on the same future.
+std::shared_future<std::shared_ptr<ModelRegistry::Model>> ModelRegistry::load (string const &model_dir) {
+    std::promise<std::shared_ptr<Model>> promise;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = models.find(model_dir);
+        if (it != models.end()) return it->second;
+        models[model_dir] = promise.get_future().share();
+    }
+    std::shared_ptr<Model> model(new Model);
+    try {
+        LOG(INFO) << "loading " << model_dir;
+        model->caffex.reset(new Caffex(model_dir, config.batch));
+    }
+    catch (...) {
+        std::shared_future<std::shared_ptr<Model>> f;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            f = models[model_dir];
+            models.erase(model_dir);
+        }
+        promise.set_exception(std::current_exception());
+        return f;
+    }
+    static Counter &loads = Metrics::global().counter("caffex_registry_loads_total", "models loaded by registries");
+    loads.add();
+    model->memory = model->caffex->memory();
+    std::shared_future<std::shared_ptr<Model>> f;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        lru.push_front(model_dir);
+        model->lru = lru.begin();
+        model->resident = true;
+        total += model->memory;
+        f = models[model_dir];
+        promise.set_value(model);
+        evict();
+    }
+    return f;
+}
+
+ModelRegistry::Lease ModelRegistry::get (string const &model_dir) {
+    std::shared_ptr<Model> model = load(model_dir).get();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (model->resident) {
+            lru.splice(lru.begin(), lru, model->lru);
+        }
+    }
+    return Lease(this, model);
+}
+
+void ModelRegistry::preload (string const &model_dir) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (models.count(model_dir)) return;
+    queue.push_back(model_dir);
+    queue_cv.notify_one();
+}
+
+size_t ModelRegistry::memory () const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return total;
+}
+
+// Called when a lease ends, with the model lock still held: the input
+// shape, and so the activation memory, may have changed.
+void ModelRegistry::release (std::shared_ptr<Model> const &model) {
+    size_t m = model->caffex->memory();
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!model->resident) return;
+    total = total - model->memory + m;
+    model->memory = m;
+    evict();
+}
+
+void ModelRegistry::evict () {
+    // the most recently used model stays even if it alone is over budget
+    while ((config.budget > 0) && (total > config.budget) && (lru.size() > 1)) {
+        string dir = lru.back();
+        auto it = models.find(dir);
+        CHECK(it != models.end());
+        // only loaded models are in the LRU list, get() does not block
+        std::shared_ptr<Model> model = it->second.get();
+        total -= model->memory;
+        model->resident = false;
+        lru.pop_back();
+        models.erase(it);
+        // leases still holding the model keep it alive until they end
+        LOG(INFO) << "evicted " << dir;
+    }
+}
+
+void ModelRegistry::worker () {
+    for (;;) {
+        string dir;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            queue_cv.wait(lock, [this]() { return stop || !queue.empty(); });
+            if (stop) break;
+            dir = queue.front();
+            queue.pop_front();
+        }
+        try {
+            load(dir).get();
+        }
+        catch (std::exception const &e) {
+            LOG(ERROR) << "failed to preload " << dir << ": " << e.what();
+        }
+    }
+}
+
+}
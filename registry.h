@@ -0,0 +1,87 @@
+#pragma once
+#include <string>
+#include <memory>
+#include <list>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <future>
+#include <condition_variable>
+#include <unordered_map>
+#include "caffex.h"
+
+namespace caffex {
+
+// Keeps Caffex instances of many model directories loaded on demand.
+// The memory of each model (weights and activations at its last input
+// shape, see Caffex::memory) is tracked, and the least recently used
+// models are dropped when the total exceeds the budget.  A model
+// requested while it is loading, by get() or by a background
+// preload(), is loaded only once and shared by all requests.
+// A Caffex is not thread-safe, so get() returns a lease that holds the
+// model's lock; leases of different models can be used concurrently.
+class ModelRegistry {
+    struct Model {
+        std::mutex mutex;               // held by the lease
+        std::unique_ptr<Caffex> caffex;
+        size_t memory;
+        std::list<string>::iterator lru;
+        bool resident;                  // in the LRU list
+    };
+public:
+    struct Config {
+        size_t budget;          // bytes, 0 for unlimited
+        unsigned batch;         // batch size of every Caffex
+        unsigned threads;       // background preload threads
+        Config (): budget(size_t(4) << 30), batch(1), threads(1) {
+        }
+    };
+
+    class Lease {
+        ModelRegistry *registry;
+        std::shared_ptr<Model> model;
+        std::unique_lock<std::mutex> lock;
+        friend class ModelRegistry;
+        Lease (ModelRegistry *r, std::shared_ptr<Model> const &m)
+            : registry(r), model(m), lock(m->mutex) {
+        }
+    public:
+        Lease (Lease &&) = default;
+        ~Lease () {
+            if (model) registry->release(model);
+        }
+        Caffex *operator -> () const {
+            return model->caffex.get();
+        }
+        Caffex &operator * () const {
+            return *model->caffex;
+        }
+    };
+
+    ModelRegistry (Config const &);
+    ~ModelRegistry ();
+    // loads model_dir if needed and blocks until it is ready
+    Lease get (string const &model_dir);
+    // queues model_dir to be loaded in the background, returns immediately
+    void preload (string const &model_dir);
+    // bytes used by the resident models
+    size_t memory () const;
+
+private:
+    Config config;
+    mutable std::mutex mutex;
+    std::unordered_map<string, std::shared_future<std::shared_ptr<Model>>> models;
+    std::list<string> lru;      // most recently used first
+    size_t total;
+    std::deque<string> queue;   // preload requests
+    std::condition_variable queue_cv;
+    vector<std::thread> workers;
+    bool stop;
+
+    std::shared_future<std::shared_ptr<Model>> load (string const &model_dir);
+    void release (std::shared_ptr<Model> const &model);
+    void evict ();              // with mutex held
+    void worker ();
+};
+
+}
@@ -4,6 +4,7 @@
 #include <vector>
 #include <algorithm>
 #include <unordered_set>
+#include <random>
 #include <boost/scoped_ptr.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/filesystem.hpp>
@@ -18,6 +19,7 @@
 #include <caffe/proto/caffe.pb.h>
 #include <caffe/util/db.hpp>
 #include <caffe/util/io.hpp>
+#include "shard.h"
 
 using namespace std;
 using namespace boost;
@@ -52,7 +54,7 @@ int main(int argc, char **argv) {
     string image_db_dir;
     string label_db_dir;
     string output_dir;
-    int N, M;
+    size_t N, M;
 
     po::options_description desc("Allowed options");
     desc.add_options()
@@ -60,8 +62,9 @@ int main(int argc, char **argv) {
     ("image", po::value(&image_db_dir), "")
     ("label", po::value(&label_db_dir), "")
     ("output", po::value(&output_dir), "")
-    (",N", po::value(&N)->default_value(200), "")
-    (",M", po::value(&M)->default_value(10000), "")
+    (",N", po::value(&N)->default_value(200), "number of samples")
+    (",M", po::value(&M)->default_value(0), "sample from the first M records only, 0 for all")
+    ("backend", po::value(&backend)->default_value(backend), "lmdb, leveldb or shard")
     ;
 
     po::positional_options_description p;
@@ -79,64 +82,101 @@ int main(int argc, char **argv) {
         return 1;
     }
   // Create new DB
-    scoped_ptr<db::DB> image_db(db::GetDB(backend));
+    scoped_ptr<db::DB> image_db(caffex::GetDB(backend));
     image_db->Open(image_db_dir, db::READ);
     scoped_ptr<db::Cursor> image_cur(image_db->NewCursor());
     image_cur->SeekToFirst();
 
-    scoped_ptr<db::DB> label_db(db::GetDB(backend));
+    scoped_ptr<db::DB> label_db(caffex::GetDB(backend));
     label_db->Open(label_db_dir, db::READ);
     scoped_ptr<db::Cursor> label_cur(label_db->NewCursor());
     label_cur->SeekToFirst();
 
-    boost::progress_display progress(M, cerr);
-    vector<cv::Mat> samples;
-    samples.reserve(N);
-    for (unsigned m = 0; m < M; ++m) {
-        cv::Mat *target = nullptr;
-        if (samples.size() < N) {
-            samples.emplace_back();
-            target = &samples.back();
+    // count the records; shard dbs know their size, others are
+    // walked without touching the values
+    caffex::ShardDB *image_shard = dynamic_cast<caffex::ShardDB *>(image_db.get());
+    caffex::ShardDB *label_shard = dynamic_cast<caffex::ShardDB *>(label_db.get());
+    size_t total = 0;
+    if (image_shard) {
+        total = image_shard->size();
+        CHECK(label_shard->size() == total);
+    }
+    else {
+        for (; image_cur->valid(); image_cur->Next()) {
+            ++total;
+            if ((M > 0) && (total >= M)) break;
         }
-        else {
-            CHECK(m >= samples.size());
-            int R = rand() % m;
-            if (R < samples.size()) {
-                target = &samples[R];
+        image_cur->SeekToFirst();
+    }
+    if ((M > 0) && (total > M)) total = M;
+    if (N > total) N = total;
+    LOG(INFO) << "Sampling " << N << " out of " << total << " records.";
+
+    // N distinct indices, uniformly at random (Floyd's algorithm)
+    vector<size_t> picks;
+    {
+        std::default_random_engine e(std::random_device{}());
+        unordered_set<size_t> picked;
+        for (size_t j = total - N; j < total; ++j) {
+            size_t r = std::uniform_int_distribution<size_t>(0, j)(e);
+            if (!picked.insert(r).second) {
+                picked.insert(j);
             }
         }
-        if (target) {
-            string iv = image_cur->value();
-            string lv = label_cur->value();
-            CHECK(image_cur->key() == label_cur->key());
-            Datum datum;
-            bool r = datum.ParseFromString(iv);
-            CHECK(r);
-            cv::Mat im = DatumToCVMat(datum);
-            r = datum.ParseFromString(lv);
-            CHECK(r);
-            cv::Mat lm = DatumToCVMat(datum);
-            if (im.channels() == 3) {
-                cvtColor(lm, lm, CV_GRAY2BGR);
-            }
-            lm *= 255;
-            lm += im;
-            cv::hconcat(im, lm, *target);
+        picks.assign(picked.begin(), picked.end());
+        sort(picks.begin(), picks.end());
+    }
+
+    vector<pair<string, string>> values(picks.size());
+    if (image_shard) {
+        // random access, no scan at all
+        for (unsigned i = 0; i < picks.size(); ++i) {
+            caffex::ShardDB::Record ir, lr;
+            image_shard->get(picks[i], &ir);
+            label_shard->get(picks[i], &lr);
+            CHECK(string(ir.key, ir.key_size) == string(lr.key, lr.key_size));
+            values[i].first.assign(ir.value, ir.value_size);
+            values[i].second.assign(lr.value, lr.value_size);
         }
-        image_cur->Next();
-        label_cur->Next();
-        if (!image_cur->valid()) {
-            CHECK(!label_cur->valid());
-            image_cur->SeekToFirst();
-            label_cur->SeekToFirst();
+    }
+    else {
+        // step both cursors to the picked positions, only those values are copied
+        size_t pos = 0;
+        for (unsigned i = 0; i < picks.size(); ++i) {
+            for (; pos < picks[i]; ++pos) {
+                image_cur->Next();
+                label_cur->Next();
+            }
+            CHECK(image_cur->valid() && label_cur->valid());
+            CHECK(image_cur->key() == label_cur->key());
+            values[i].first = image_cur->value();
+            values[i].second = label_cur->value();
         }
-        ++progress;
     }
+
     fs::path root(output_dir);
     fs::create_directories(root);
-    for (unsigned i = 0; i < samples.size(); ++i) {
-        fs::path out(root/fs::path(fmt::format("{}.png", i)));
-        cv::imwrite(out.native(), samples[i]);
+    boost::progress_display progress(values.size(), cerr);
+#pragma omp parallel for schedule(dynamic, 1)
+    for (unsigned i = 0; i < values.size(); ++i) {
+        Datum datum;
+        bool r = datum.ParseFromString(values[i].first);
+        CHECK(r);
+        cv::Mat im = DatumToCVMat(datum);
+        r = datum.ParseFromString(values[i].second);
+        CHECK(r);
+        cv::Mat lm = DatumToCVMat(datum);
+        if (im.channels() == 3) {
+            cvtColor(lm, lm, CV_GRAY2BGR);
+        }
+        lm *= 255;
+        lm += im;
+        cv::Mat out;
+        cv::hconcat(im, lm, out);
+        fs::path path(root/fs::path(fmt::format("{}.png", i)));
+        cv::imwrite(path.native(), out);
+#pragma omp critical
+        ++progress;
     }
 
     return 0;
@@ -0,0 +1,214 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <boost/format.hpp>
+#include <boost/filesystem.hpp>
+#include <glog/logging.h>
+#include "shard.h"
+
+namespace caffex {
+
+namespace fs = boost::filesystem;
+using namespace caffe::db;
+
+static const unsigned SHARD_BITS = 48;
+static const uint64_t OFFSET_MASK = (uint64_t(1) << SHARD_BITS) - 1;
+// how far ahead of the cursor we ask the kernel to read
+static const size_t PREFETCH_RECORDS = 256;
+
+static void map_file (string const &path, char const **data, size_t *size) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    PCHECK(fd >= 0) << "cannot open " << path;
+    struct stat st;
+    PCHECK(::fstat(fd, &st) == 0);
+    *size = st.st_size;
+    *data = nullptr;
+    if (*size > 0) {
+        void *p = ::mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+        PCHECK(p != MAP_FAILED) << "cannot mmap " << path;
+        *data = reinterpret_cast<char const *>(p);
+    }
+    ::close(fd);
+}
+
+ShardDB::ShardDB (size_t shard_size_)
+    : mode(READ), shard_size(shard_size_),
+    index(nullptr), index_size(0),
+    shard_file(nullptr), index_file(nullptr),
+    shard_id(0), shard_offset(0)
+{
+    index_map.data = nullptr;
+    index_map.size = 0;
+    CHECK(shard_size <= OFFSET_MASK);
+}
+
+string ShardDB::shardPath (unsigned id) const {
+    return (fs::path(dir) / fs::path((boost::format("shard-%05d") % id).str())).native();
+}
+
+void ShardDB::Open (const string& source, Mode mode_) {
+    Close();
+    dir = source;
+    mode = mode_;
+    string index_path = (fs::path(dir) / fs::path("index")).native();
+    if (mode == READ) {
+        map_file(index_path, &index_map.data, &index_map.size);
+        CHECK(index_map.size % sizeof(uint64_t) == 0) << "corrupted index " << index_path;
+        index = reinterpret_cast<uint64_t const *>(index_map.data);
+        index_size = index_map.size / sizeof(uint64_t);
+        for (unsigned id = 0; fs::exists(shardPath(id)); ++id) {
+            Mapping m;
+            map_file(shardPath(id), &m.data, &m.size);
+            shards.push_back(m);
+        }
+        LOG(INFO) << "Opened shard db " << source << ": " << index_size << " records in " << shards.size() << " shards.";
+        return;
+    }
+    if (mode == NEW) {
+        CHECK(fs::create_directory(dir)) << "mkdir " << source << " failed";
+        index_file = fopen(index_path.c_str(), "wb");
+        PCHECK(index_file) << "cannot create " << index_path;
+        openShardForWrite(0);
+    }
+    else {
+        index_file = fopen(index_path.c_str(), "ab");
+        PCHECK(index_file) << "cannot open " << index_path;
+        unsigned last = 0;
+        while (fs::exists(shardPath(last + 1))) ++last;
+        openShardForWrite(last);
+    }
+}
+
+void ShardDB::openShardForWrite (unsigned id) {
+    if (shard_file) {
+        PCHECK(fclose(shard_file) == 0);
+    }
+    shard_id = id;
+    string path = shardPath(id);
+    shard_file = fopen(path.c_str(), "ab");
+    PCHECK(shard_file) << "cannot open " << path;
+    PCHECK(fseek(shard_file, 0, SEEK_END) == 0);
+    shard_offset = ftell(shard_file);
+}
+
+void ShardDB::append (string const &key, string const &value) {
+    size_t record_size = 2 * sizeof(uint32_t) + key.size() + value.size();
+    if ((shard_offset > 0) && (shard_offset + record_size > shard_size)) {
+        openShardForWrite(shard_id + 1);
+    }
+    CHECK(shard_offset + record_size <= OFFSET_MASK) << "record too large";
+    uint32_t sizes[] = {uint32_t(key.size()), uint32_t(value.size())};
+    uint64_t entry = (uint64_t(shard_id) << SHARD_BITS) | shard_offset;
+    CHECK(fwrite(sizes, sizeof(sizes), 1, shard_file) == 1);
+    CHECK(fwrite(key.data(), 1, key.size(), shard_file) == key.size());
+    CHECK(fwrite(value.data(), 1, value.size(), shard_file) == value.size());
+    CHECK(fwrite(&entry, sizeof(entry), 1, index_file) == 1);
+    shard_offset += record_size;
+}
+
+void ShardDB::flush () {
+    // data must hit the shard before the index refers to it
+    PCHECK(fflush(shard_file) == 0);
+    PCHECK(fflush(index_file) == 0);
+}
+
+void ShardDB::Close () {
+    for (auto const &m: shards) {
+        if (m.data) ::munmap(const_cast<char *>(m.data), m.size);
+    }
+    shards.clear();
+    if (index_map.data) {
+        ::munmap(const_cast<char *>(index_map.data), index_map.size);
+    }
+    index_map.data = nullptr;
+    index_map.size = 0;
+    index = nullptr;
+    index_size = 0;
+    if (shard_file) {
+        flush();
+        PCHECK(fclose(shard_file) == 0);
+        PCHECK(fclose(index_file) == 0);
+    }
+    shard_file = index_file = nullptr;
+}
+
+void ShardDB::get (size_t i, Record *rec) const {
+    CHECK(i < index_size);
+    uint64_t entry = index[i];
+    unsigned id = entry >> SHARD_BITS;
+    uint64_t off = entry & OFFSET_MASK;
+    CHECK(id < shards.size());
+    Mapping const &m = shards[id];
+    CHECK(off + 2 * sizeof(uint32_t) <= m.size) << "corrupted index";
+    uint32_t const *sizes = reinterpret_cast<uint32_t const *>(m.data + off);
+    rec->key_size = sizes[0];
+    rec->value_size = sizes[1];
+    rec->key = m.data + off + 2 * sizeof(uint32_t);
+    rec->value = rec->key + rec->key_size;
+    CHECK(rec->value + rec->value_size <= m.data + m.size) << "truncated shard";
+}
+
+void ShardDB::prefetch (size_t begin, size_t end) const {
+    if (end > index_size) end = index_size;
+    if (begin >= end) return;
+    // records of a range are contiguous within each shard
+    static const size_t page = ::sysconf(_SC_PAGESIZE);
+    size_t i = begin;
+    while (i < end) {
+        unsigned id = index[i] >> SHARD_BITS;
+        uint64_t from = index[i] & OFFSET_MASK;
+        size_t j = i + 1;
+        while ((j < end) && ((index[j] >> SHARD_BITS) == id)) ++j;
+        Mapping const &m = shards[id];
+        uint64_t to = (j < index_size) && ((index[j] >> SHARD_BITS) == id) ? (index[j] & OFFSET_MASK) : m.size;
+        from -= from % page;
+        ::madvise(const_cast<char *>(m.data) + from, to - from, MADV_WILLNEED);
+        i = j;
+    }
+}
+
+void ShardCursor::seek (size_t i) {
+    cur = i;
+    if (cur >= db->size()) return;
+    if ((cur < prefetch_begin) || (cur >= prefetch_end)) {
+        // random jump, restart the read-ahead window
+        prefetch_begin = cur;
+        prefetch_end = cur + PREFETCH_RECORDS;
+        db->prefetch(prefetch_begin, prefetch_end);
+    }
+    else if (cur + PREFETCH_RECORDS / 2 >= prefetch_end) {
+        // sequential scan, extend the window before we run out
+        db->prefetch(prefetch_end, prefetch_end + PREFETCH_RECORDS);
+        prefetch_end += PREFETCH_RECORDS;
+    }
+    db->get(cur, &rec);
+}
+
+Cursor *ShardDB::NewCursor () {
+    CHECK(mode == READ) << "cursor requires READ mode";
+    return new ShardCursor(this);
+}
+
+Transaction *ShardDB::NewTransaction () {
+    CHECK(mode != READ) << "transaction requires NEW or WRITE mode";
+    return new ShardTransaction(this);
+}
+
+void ShardTransaction::Commit () {
+    for (auto const &p: batch) {
+        db->append(p.first, p.second);
+    }
+    db->flush();
+    batch.clear();
+}
+
+caffe::db::DB *GetDB (string const &backend) {
+    if (backend == "shard") {
+        return new ShardDB();
+    }
+    return caffe::db::GetDB(backend);
+}
+
+}
+
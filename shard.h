@@ -0,0 +1,111 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <caffe/util/db.hpp>
+
+namespace caffex {
+
+using std::string;
+using std::vector;
+
+// Packed shard backend
+// A database is a directory that contains the following files:
+//  - shard-00000, shard-00001, ...: append-only record files
+//  - index: one 64-bit entry per record, (shard << 48) | offset
+// Each record is stored as
+//      uint32 key_size, uint32 value_size, key bytes, value bytes
+// Shards never change once closed, so a database can be copied, rsynced
+// or split across machines with plain file tools.
+// Readers mmap all files, so records can be accessed without copying,
+// either sequentially through the cursor or randomly by index.
+class ShardDB: public caffe::db::DB {
+public:
+    struct Record {
+        char const *key;
+        char const *value;
+        uint32_t key_size;
+        uint32_t value_size;
+    };
+
+    ShardDB (size_t shard_size = (size_t(1) << 30));
+    virtual ~ShardDB () { Close(); }
+    virtual void Open (const string& source, caffe::db::Mode mode);
+    virtual void Close ();
+    virtual caffe::db::Cursor *NewCursor ();
+    virtual caffe::db::Transaction *NewTransaction ();
+
+    // random access, only available in READ mode
+    size_t size () const {
+        return index_size;
+    }
+    void get (size_t i, Record *) const;
+    // hint the kernel that records [begin, end) will be read soon
+    void prefetch (size_t begin, size_t end) const;
+
+private:
+    friend class ShardTransaction;
+    struct Mapping {
+        char const *data;
+        size_t size;
+    };
+    string dir;
+    caffe::db::Mode mode;
+    size_t shard_size;
+    // READ mode
+    vector<Mapping> shards;
+    Mapping index_map;
+    uint64_t const *index;
+    size_t index_size;
+    // WRITE/NEW mode
+    FILE *shard_file;
+    FILE *index_file;
+    unsigned shard_id;
+    uint64_t shard_offset;
+
+    string shardPath (unsigned id) const;
+    void openShardForWrite (unsigned id);
+    void append (string const &key, string const &value);
+    void flush ();
+};
+
+class ShardCursor: public caffe::db::Cursor {
+    ShardDB const *db;
+    size_t cur;
+    size_t prefetch_begin, prefetch_end;
+    ShardDB::Record rec;
+public:
+    ShardCursor (ShardDB const *db_): db(db_), cur(0), prefetch_begin(0), prefetch_end(0) {
+        SeekToFirst();
+    }
+    virtual void SeekToFirst () { seek(0); }
+    virtual void Next () { seek(cur + 1); }
+    virtual string key () { return string(rec.key, rec.key_size); }
+    virtual string value () { return string(rec.value, rec.value_size); }
+    virtual bool valid () { return cur < db->size(); }
+    // position the cursor at the i-th record
+    void seek (size_t i);
+    // zero-copy access to the current record, valid until the db is closed
+    ShardDB::Record const &record () const {
+        return rec;
+    }
+};
+
+class ShardTransaction: public caffe::db::Transaction {
+    ShardDB *db;
+    vector<std::pair<string, string>> batch;
+public:
+    ShardTransaction (ShardDB *db_): db(db_) {
+    }
+    virtual void Put (const string& key, const string& value) {
+        batch.emplace_back(key, value);
+    }
+    virtual void Commit ();
+};
+
+// Same as caffe::db::GetDB, with the additional "shard" backend.
+caffe::db::DB *GetDB (string const &backend);
+
+}
+
@@ -0,0 +1,163 @@
+// Tests of TraceContour: hand-checked contours of diagonally connected
+// masks, and invariants of the contour on random masks.
+#include <string>
+#include <vector>
+#include <random>
+#include <iostream>
+#include <glog/logging.h>
+#include "bbox.h"
+
+using namespace std;
+
+// '#' is region 0, '.' background
+static cv::Mat Labels (vector<string> const &rows) {
+    cv::Mat labels(rows.size(), rows[0].size(), CV_32SC1, cv::Scalar(-1));
+    for (unsigned y = 0; y < rows.size(); ++y) {
+        for (unsigned x = 0; x < rows[y].size(); ++x) {
+            if (rows[y][x] == '#') labels.ptr<int>(y)[x] = 0;
+        }
+    }
+    return labels;
+}
+
+static cv::Point First (cv::Mat const &labels) {
+    for (int y = 0; y < labels.rows; ++y) {
+        for (int x = 0; x < labels.cols; ++x) {
+            if (labels.ptr<int>(y)[x] == 0) return cv::Point(x, y);
+        }
+    }
+    return cv::Point(-1, -1);
+}
+
+static string Str (vector<cv::Point> const &contour) {
+    string s;
+    for (auto const &p: contour) {
+        s += "(" + to_string(p.x) + "," + to_string(p.y) + ")";
+    }
+    return s;
+}
+
+static void Expect (vector<string> const &mask, vector<cv::Point> const &expected) {
+    cv::Mat labels = Labels(mask);
+    vector<cv::Point> contour;
+    caffex::TraceContour(labels, 0, First(labels), &contour);
+    CHECK(contour == expected) << "got " << Str(contour) << " expected " << Str(expected);
+}
+
+// Region pixels 4-adjacent to the background outside the region, which
+// is 4-connected since regions are 8-connected, must all be on the
+// outer contour; the contour must stay in the region, move between
+// 8-neighbors and pass each pixel at most 4 times.
+static void Check (cv::Mat const &labels) {
+    int rows = labels.rows, cols = labels.cols;
+    auto region = [&](int x, int y) {
+        return (x >= 0) && (y >= 0) && (x < cols) && (y < rows) && (labels.ptr<int>(y)[x] == 0);
+    };
+    // flood the background from outside, on a frame one pixel wider
+    int W = cols + 2, H = rows + 2;
+    vector<char> outside(W * H, 0);
+    vector<int> stack{0};
+    outside[0] = 1;
+    while (!stack.empty()) {
+        int i = stack.back();
+        stack.pop_back();
+        int x = i % W, y = i / W;
+        int const dx[] = {1, -1, 0, 0}, dy[] = {0, 0, 1, -1};
+        for (int k = 0; k < 4; ++k) {
+            int nx = x + dx[k], ny = y + dy[k];
+            if ((nx < 0) || (ny < 0) || (nx >= W) || (ny >= H)) continue;
+            if (outside[ny * W + nx] || region(nx - 1, ny - 1)) continue;
+            outside[ny * W + nx] = 1;
+            stack.push_back(ny * W + nx);
+        }
+    }
+    vector<cv::Point> contour;
+    caffex::TraceContour(labels, 0, First(labels), &contour);
+    vector<int> seen(rows * cols, 0);
+    unsigned area = 0;
+    for (int y = 0; y < rows; ++y) {
+        for (int x = 0; x < cols; ++x) {
+            area += region(x, y);
+        }
+    }
+    CHECK(contour.size() <= 4 * area) << Str(contour);
+    for (unsigned i = 0; i < contour.size(); ++i) {
+        cv::Point p = contour[i];
+        cv::Point q = contour[(i + 1) % contour.size()];
+        CHECK(region(p.x, p.y)) << Str(contour);
+        CHECK(++seen[p.y * cols + p.x] <= 4) << Str(contour);
+        if (contour.size() > 1) {
+            CHECK((p != q) && (abs(p.x - q.x) <= 1) && (abs(p.y - q.y) <= 1)) << Str(contour);
+        }
+    }
+    for (int y = 0; y < rows; ++y) {
+        for (int x = 0; x < cols; ++x) {
+            if (!region(x, y)) continue;
+            bool border = outside[(y + 1) * W + x + 2] || outside[(y + 1) * W + x]
+                       || outside[(y + 2) * W + x + 1] || outside[y * W + x + 1];
+            CHECK(!border || seen[y * cols + x]) << "(" << x << "," << y << ") missed by " << Str(contour);
+        }
+    }
+}
+
+int main (int argc, char **argv) {
+    google::InitGoogleLogging(argv[0]);
+    typedef cv::Point P;
+    Expect({"#"}, {P(0, 0)});
+    Expect({"##"}, {P(0, 0), P(1, 0)});
+    Expect({"##",
+            "#.",
+            ".#"}, {P(0, 0), P(1, 0), P(0, 1), P(1, 2), P(0, 1)});
+    Expect({"#.",
+            ".#",
+            "#."}, {P(0, 0), P(1, 1), P(0, 2), P(1, 1)});
+    Expect({".#",
+            "#.",
+            ".#"}, {P(1, 0), P(0, 1), P(1, 2), P(0, 1)});
+    Expect({"#..",
+            ".#.",
+            "..#"}, {P(0, 0), P(1, 1), P(2, 2), P(1, 1)});
+    Expect({"###",
+            "#.#",
+            "###"}, {P(0, 0), P(1, 0), P(2, 0), P(2, 1), P(2, 2), P(1, 2), P(0, 2), P(0, 1)});
+
+    // random masks, keeping the 8-connected component of the first pixel
+    std::default_random_engine e(2016);
+    for (int n = 0; n < 5000; ++n) {
+        int rows = 1 + e() % 7, cols = 1 + e() % 7;
+        cv::Mat mask(rows, cols, CV_32SC1, cv::Scalar(-1));
+        for (int y = 0; y < rows; ++y) {
+            for (int x = 0; x < cols; ++x) {
+                if (e() % 2) mask.ptr<int>(y)[x] = 1;
+            }
+        }
+        cv::Point s(-1, -1);
+        for (int y = 0; (y < rows) && (s.x < 0); ++y) {
+            for (int x = 0; x < cols; ++x) {
+                if (mask.ptr<int>(y)[x] == 1) {
+                    s = cv::Point(x, y);
+                    break;
+                }
+            }
+        }
+        if (s.x < 0) continue;
+        vector<cv::Point> stack{s};
+        mask.ptr<int>(s.y)[s.x] = 0;
+        while (!stack.empty()) {
+            cv::Point p = stack.back();
+            stack.pop_back();
+            for (int dy = -1; dy <= 1; ++dy) {
+                for (int dx = -1; dx <= 1; ++dx) {
+                    int x = p.x + dx, y = p.y + dy;
+                    if ((x < 0) || (y < 0) || (x >= cols) || (y >= rows)) continue;
+                    if (mask.ptr<int>(y)[x] != 1) continue;
+                    mask.ptr<int>(y)[x] = 0;
+                    stack.push_back(cv::Point(x, y));
+                }
+            }
+        }
+        Check(mask);
+    }
+    cout << "test-bbox: ok" << endl;
+    return 0;
+}
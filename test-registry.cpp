@@ -0,0 +1,111 @@
+// Tests of ModelRegistry on tiny generated FCN models: concurrent
+// requests share one load, an evicted model stays usable while leased,
+// and the end of a lease updates the memory figure.
+#include <string>
+#include <vector>
+#include <thread>
+#include <fstream>
+#include <iostream>
+#include <boost/filesystem.hpp>
+#include <glog/logging.h>
+#include "registry.h"
+#include "metrics.h"
+
+using namespace std;
+namespace fs = boost::filesystem;
+
+// a 1x1 convolution with constant weights, so no training is needed
+static void MakeModel (fs::path const &dir, int outputs) {
+    fs::create_directories(dir);
+    string model = (dir / "caffe.model").native();
+    {
+        ofstream os(model);
+        os << "name: \"test\"\n"
+           << "input: \"data\"\n"
+           << "input_shape { dim: 1 dim: 3 dim: 1 dim: 1 }\n"
+           << "layer { name: \"conv\" type: \"Convolution\" bottom: \"data\" top: \"conv\"\n"
+           << "  convolution_param { num_output: " << outputs << " kernel_size: 1\n"
+           << "    weight_filler { type: \"constant\" value: 0.01 } } }\n";
+        CHECK(os) << "cannot write " << model;
+    }
+    caffe::Net<float> net(model, caffe::TEST);
+    caffe::NetParameter params;
+    net.ToProto(&params);
+    caffe::WriteProtoToBinaryFile(params, (dir / "caffe.params").native());
+}
+
+int main (int argc, char **argv) {
+    google::InitGoogleLogging(argv[0]);
+    fs::path root = fs::temp_directory_path() / fs::unique_path("test-registry-%%%%-%%%%");
+    string a = (root / "a").native(), b = (root / "b").native();
+    MakeModel(a, 2);
+    MakeModel(b, 4);
+    caffex::Counter &loads = caffex::Metrics::global().counter("caffex_registry_loads_total", "models loaded by registries");
+    cv::Mat small(16, 16, CV_8UC3, cv::Scalar(1, 2, 3));
+    cv::Mat large(64, 64, CV_8UC3, cv::Scalar(1, 2, 3));
+    vector<float> ft;
+    {
+        // concurrent requests for one model load it once
+        caffex::ModelRegistry::Config config;
+        config.budget = 0;
+        caffex::ModelRegistry registry(config);
+        uint64_t before = loads.get();
+        vector<caffex::Caffex *> seen(8);
+        vector<std::thread> threads;
+        for (unsigned i = 0; i < seen.size(); ++i) {
+            threads.emplace_back([&, i]() {
+                auto lease = registry.get(a);
+                seen[i] = &*lease;
+            });
+        }
+        for (auto &th: threads) th.join();
+        CHECK(loads.get() == before + 1) << loads.get() - before << " loads";
+        for (auto p: seen) CHECK(p == seen[0]);
+
+        // the figure follows the activations when a lease ends, and
+        // does not shrink with the input as blobs keep their memory
+        size_t m0 = registry.memory();
+        size_t m1;
+        {
+            auto lease = registry.get(a);
+            lease->apply(large, &ft);
+            m1 = lease->memory();
+        }
+        CHECK(m1 > m0) << m1 << " " << m0;
+        CHECK(registry.memory() == m1) << registry.memory() << " " << m1;
+        {
+            auto lease = registry.get(a);
+            lease->apply(small, &ft);
+        }
+        CHECK(registry.memory() == m1) << registry.memory() << " " << m1;
+    }
+    {
+        // a model evicted while leased stays usable until the lease ends
+        caffex::ModelRegistry::Config config;
+        config.budget = 1;      // only the most recent model fits
+        caffex::ModelRegistry registry(config);
+        uint64_t before = loads.get();
+        auto held = registry.get(a);
+        size_t mb;
+        {
+            auto lease = registry.get(b);
+            mb = lease->memory();
+        }
+        CHECK(registry.memory() == mb) << registry.memory() << " " << mb;
+        held->apply(large, &ft);
+        CHECK(ft.size() == 2 * 64 * 64) << ft.size();
+        for (float v: ft) CHECK(std::abs(v - 0.06f) < 1e-4) << v;
+        {
+            // the lease of an evicted model is not counted when it ends
+            caffex::ModelRegistry::Lease gone(std::move(held));
+        }
+        CHECK(registry.memory() == mb) << registry.memory() << " " << mb;
+        // requested again, the model is loaded again
+        auto again = registry.get(a);
+        CHECK(loads.get() == before + 3) << loads.get() - before << " loads";
+        CHECK(registry.memory() == again->memory()) << registry.memory();
+    }
+    fs::remove_all(root);
+    cout << "test-registry: ok" << endl;
+    return 0;
+}
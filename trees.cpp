@@ -0,0 +1,180 @@
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <fstream>
+#include <algorithm>
+#include <glog/logging.h>
+#include "trees.h"
+
+namespace caffex {
+
+namespace {
+    // a node as it appears in the dump
+    struct DumpNode {
+        bool leaf;
+        unsigned feature;
+        float value;    // threshold or leaf value
+        int yes, no, missing;
+    };
+
+    // parses "key=value" out of s, returns false if missing
+    bool field (string const &s, char const *key, int *v) {
+        size_t p = s.find(key);
+        if (p == string::npos) return false;
+        *v = std::atoi(s.c_str() + p + std::strlen(key));
+        return true;
+    }
+
+    bool parse (string const &line, int feature_base, unsigned *id, DumpNode *node) {
+        size_t b = line.find_first_not_of(" \t");
+        if (b == string::npos) return false;
+        size_t colon = line.find(':', b);
+        if (colon == string::npos) return false;
+        *id = std::atoi(line.c_str() + b);
+        char const *p = line.c_str() + colon + 1;
+        if (std::strncmp(p, "leaf=", 5) == 0) {
+            node->leaf = true;
+            node->value = std::strtof(p + 5, nullptr);
+            return true;
+        }
+        // [f12<0.5] yes=1,no=2,missing=1
+        if ((p[0] != '[') || (p[1] != 'f')) return false;
+        char *e;
+        long f = std::strtol(p + 2, &e, 10);
+        if ((e == p + 2) || (*e != '<')) return false;
+        CHECK(f >= feature_base) << "feature f" << f << " below feature base " << feature_base;
+        node->leaf = false;
+        node->feature = f - feature_base;
+        node->value = std::strtof(e + 1, nullptr);
+        string rest(e);
+        if (!field(rest, "yes=", &node->yes) || !field(rest, "no=", &node->no)) return false;
+        if (!field(rest, "missing=", &node->missing)) node->missing = node->yes;
+        return true;
+    }
+}
+
+TreeEnsemble::TreeEnsemble (string const &dump_path, int objective_, float base_score, unsigned feature_base)
+    : objective(objective_), n_features(0) {
+    if (objective == LOGISTIC) {
+        CHECK((base_score > 0) && (base_score < 1));
+        base_margin = -std::log(1.0f / base_score - 1.0f);
+    }
+    else {
+        base_margin = base_score;
+    }
+    std::ifstream is(dump_path.c_str());
+    CHECK(is) << "cannot open " << dump_path;
+    vector<vector<DumpNode>> dump;
+    vector<vector<bool>> seen;
+    string line;
+    while (getline(is, line)) {
+        if (line.compare(0, 8, "booster[") == 0) {
+            dump.emplace_back();
+            seen.emplace_back();
+            continue;
+        }
+        unsigned id;
+        DumpNode node;
+        if (!parse(line, feature_base, &id, &node)) {
+            CHECK(line.find_first_not_of(" \t\r") == string::npos) << "bad line in " << dump_path << ": " << line;
+            continue;
+        }
+        CHECK(dump.size()) << "node before booster[] in " << dump_path;
+        auto &tree = dump.back();
+        if (tree.size() <= id) {
+            tree.resize(id + 1);
+            seen.back().resize(id + 1, false);
+        }
+        tree[id] = node;
+        seen.back()[id] = true;
+    }
+    CHECK(dump.size()) << "no trees in " << dump_path;
+
+    // lay each tree out breadth first with siblings adjacent
+    vector<std::pair<unsigned, uint32_t>> queue;    // (dump id, flat index)
+    for (unsigned t = 0; t < dump.size(); ++t) {
+        auto const &tree = dump[t];
+        CHECK(tree.size() && seen[t][0]) << "tree " << t << " has no root";
+        roots.push_back(nodes.size());
+        nodes.emplace_back();
+        missing_right.push_back(0);
+        queue.clear();
+        queue.emplace_back(0, roots.back());
+        vector<unsigned> level(1, 0);
+        unsigned depth = 0;
+        for (unsigned q = 0; q < queue.size(); ++q) {
+            unsigned id = queue[q].first;
+            uint32_t at = queue[q].second;
+            DumpNode const &dn = tree[id];
+            Node &n = nodes[at];
+            n.leaf = 0;
+            if (dn.leaf) {
+                n.feature = 0;
+                n.threshold = std::numeric_limits<float>::quiet_NaN();
+                n.child = at;
+                n.leaf = dn.value;
+                continue;
+            }
+            CHECK((dn.yes >= 0) && (unsigned(dn.yes) < tree.size()) && seen[t][dn.yes]
+                    && (dn.no >= 0) && (unsigned(dn.no) < tree.size()) && seen[t][dn.no])
+                << "bad children of node " << id << " in tree " << t;
+            n.feature = dn.feature;
+            n.threshold = dn.value;
+            n.child = nodes.size();
+            missing_right[at] = (dn.missing == dn.no);
+            n_features = std::max(n_features, dn.feature + 1);
+            uint32_t child = nodes.size();
+            nodes.emplace_back();
+            nodes.emplace_back();
+            missing_right.push_back(0);
+            missing_right.push_back(0);
+            queue.emplace_back(dn.yes, child);
+            queue.emplace_back(dn.no, child + 1);
+            level.push_back(level[q] + 1);
+            level.push_back(level[q] + 1);
+            depth = std::max(depth, level[q] + 1);
+            CHECK(queue.size() <= tree.size()) << "tree " << t << " is not a tree";
+        }
+        depths.push_back(depth);
+    }
+}
+
+void TreeEnsemble::predict (float const *rows, size_t stride, unsigned n, float *out) const {
+    static unsigned const BLOCK = 64;
+    uint32_t at[BLOCK];
+    for (unsigned begin = 0; begin < n; begin += BLOCK) {
+        unsigned m = std::min(BLOCK, n - begin);
+        float const *block = rows + begin * stride;
+        float *margin = out + begin;
+        for (unsigned i = 0; i < m; ++i) {
+            margin[i] = base_margin;
+        }
+        for (unsigned t = 0; t < roots.size(); ++t) {
+            for (unsigned i = 0; i < m; ++i) {
+                at[i] = roots[t];
+            }
+            for (unsigned d = 0; d < depths[t]; ++d) {
+                for (unsigned i = 0; i < m; ++i) {
+                    Node const &node = nodes[at[i]];
+                    float x = block[i * stride + node.feature];
+                    // leaves have a NaN threshold so both tests fail
+                    // and they stay put; a NaN feature goes where the
+                    // dump says missing values go
+                    bool right = missing_right[at[i]] ? !(x < node.threshold) : (x >= node.threshold);
+                    at[i] = node.child + right;
+                }
+            }
+            for (unsigned i = 0; i < m; ++i) {
+                margin[i] += nodes[at[i]].leaf;
+            }
+        }
+        if (objective == LOGISTIC) {
+            for (unsigned i = 0; i < m; ++i) {
+                margin[i] = 1.0f / (1.0f + std::exp(-margin[i]));
+            }
+        }
+    }
+}
+
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace caffex {
+
+using std::string;
+using std::vector;
+
+// Tree ensemble loaded from an xgboost text dump, e.g.
+//      booster[0]:
+//      0:[f12<0.5] yes=1,no=2,missing=1
+//          1:leaf=0.1
+//          ...
+// (as written by xgboost dump with or without stats), so models can be
+// scored without linking xgboost.
+// Nodes of all trees live in one flat array.  The two children of a
+// node are adjacent, so a step is child + (go right), and leaves point
+// to themselves with a NaN threshold; every row then walks each tree for
+// exactly its depth without branching on the node type.  Rows are
+// processed in blocks so the nodes of a tree stay in cache.
+class TreeEnsemble {
+public:
+    enum Objective {
+        LINEAR = 0,     // raw margin, reg:linear
+        LOGISTIC = 1    // sigmoid of margin, binary:logistic
+    };
+
+    // feature_base is subtracted from the feature ids of the dump,
+    // e.g. 1 for models trained on the libsvm output of caffex-extract
+    TreeEnsemble (string const &dump_path, int objective = LOGISTIC, float base_score = 0.5, unsigned feature_base = 1);
+
+    unsigned trees () const {
+        return roots.size();
+    }
+    // minimal number of features a row must have
+    unsigned features () const {
+        return n_features;
+    }
+    // scores rows of features, rows are stride floats apart
+    void predict (float const *rows, size_t stride, unsigned n, float *out) const;
+
+private:
+    struct Node {
+        uint32_t feature;
+        float threshold;    // go right unless x < threshold, NaN for leaves
+        uint32_t child;     // left child, right child is child + 1, self for leaves
+        float leaf;
+    };
+    vector<Node> nodes;
+    vector<uint32_t> roots;
+    vector<uint32_t> depths;
+    vector<uint8_t> missing_right;  // per node, where NaN features go
+    int objective;
+    float base_margin;
+    unsigned n_features;
+};
+
+}
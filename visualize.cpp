@@ -1,4 +1,11 @@
 #include <iostream>
+#include <sstream>
+#include <map>
+#include <deque>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <boost/assert.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/filesystem.hpp>
@@ -28,6 +35,116 @@ using namespace std;
 using namespace boost;
 namespace fs = boost::filesystem;
 
+// [image * prob | prob | image], built directly in 8 bits
+static void Overlay (cv::Mat const &input, cv::Mat const &prob, cv::Mat *vis) {
+    CHECK(input.type() == CV_8UC3);
+    int cols = input.cols;
+    vis->create(input.rows, cols * 3, CV_8UC3);
+    for (int y = 0; y < input.rows; ++y) {
+        uint8_t const *in = input.ptr<uint8_t>(y);
+        float const *p = prob.ptr<float>(y);
+        uint8_t *masked = vis->ptr<uint8_t>(y);
+        uint8_t *gray = masked + cols * 3;
+        uint8_t *orig = gray + cols * 3;
+        for (int x = 0; x < cols; ++x) {
+            // probability in 8.8 fixed point
+            unsigned w = unsigned(std::min(std::max(p[x], 0.0f), 1.0f) * 256);
+            uint8_t g = std::min(w, 255u);
+            for (int c = 0; c < 3; ++c) {
+                masked[c] = (in[c] * w) >> 8;
+                gray[c] = g;
+                orig[c] = in[c];
+            }
+            in += 3;
+            masked += 3;
+            gray += 3;
+            orig += 3;
+        }
+    }
+}
+
+// A rendered image waiting to be encoded.
+struct Job {
+    unsigned index;
+    cv::Mat vis;
+    string line;    // stdout line, empty if the image failed to load
+};
+
+// Encodes overlays on a few threads while the detectors keep running,
+// and prints the stdout lines in input order.
+class Writer {
+    fs::path odir;
+    unsigned max_queue;
+    std::mutex mutex;
+    std::condition_variable push_cv;
+    std::condition_variable pop_cv;
+    std::deque<Job> queue;
+    bool done;
+    std::map<unsigned, string> pending;     // finished lines out of order
+    unsigned next_line;
+    vector<std::thread> threads;
+
+    void finish (unsigned index, string const &line) {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending[index] = line;
+        auto it = pending.begin();
+        while ((it != pending.end()) && (it->first == next_line)) {
+            if (it->second.size()) {
+                cout << it->second << endl;
+            }
+            ++next_line;
+            it = pending.erase(it);
+        }
+    }
+
+    void run () {
+        for (;;) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                pop_cv.wait(lock, [this]() { return done || !queue.empty(); });
+                if (queue.empty()) break;
+                job = std::move(queue.front());
+                queue.pop_front();
+            }
+            push_cv.notify_one();
+            if (job.vis.total()) {
+                fs::path path = odir / (lexical_cast<string>(job.index) + ".jpg");
+                if (!cv::imwrite(path.native(), job.vis)) {
+                    LOG(ERROR) << "failed to write " << path;
+                }
+            }
+            finish(job.index, job.line);
+        }
+    }
+public:
+    Writer (fs::path const &odir_, unsigned threads_, unsigned max_queue_)
+        : odir(odir_), max_queue(max_queue_), done(false), next_line(0) {
+        for (unsigned i = 0; i < threads_; ++i) {
+            threads.emplace_back([this]() { run(); });
+        }
+    }
+    ~Writer () {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            done = true;
+        }
+        pop_cv.notify_all();
+        for (auto &th: threads) {
+            th.join();
+        }
+    }
+    // blocks while the queue is full, so memory stays bounded
+    void push (Job &&job) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            push_cv.wait(lock, [this]() { return queue.size() < max_queue; });
+            queue.push_back(std::move(job));
+        }
+        pop_cv.notify_one();
+    }
+};
+
 int main(int argc, char **argv) {
     namespace po = boost::program_options; 
     string model;
@@ -38,6 +155,10 @@ int main(int argc, char **argv) {
     float b_keep;
     float b_sth;
     float b_ssp;
+    unsigned threads;
+    unsigned encoders;
+    vector<float> tta_scales;
+    caffex::Caffex::Cascade cascade;
 
 
     po::options_description desc("Allowed options");
@@ -51,6 +172,13 @@ int main(int argc, char **argv) {
     ("sth", po::value(&b_sth)->default_value(0.2), "")
     ("ssp", po::value(&b_ssp)->default_value(0.2), "")
     ("max", po::value(&max)->default_value(-1), "")
+    ("threads", po::value(&threads)->default_value(1), "detector threads, each loads its own copy of the model")
+    ("encoders", po::value(&encoders)->default_value(2), "jpeg encoding threads")
+    ("scales", po::value(&tta_scales)->multitoken(), "average the model output over these scales")
+    ("flip", "average the model output with that of the mirrored image")
+    ("cascade", po::value(&cascade.scale)->default_value(1), "scale of a coarse pass, only ambiguous tiles are run at full size; 1 for off")
+    ("tile", po::value(&cascade.tile)->default_value(cascade.tile), "cascade tile size")
+    ("confident", po::value(&cascade.th_high)->default_value(cascade.th_high), "cascade keeps the coarse output of tiles with foreground above this")
     ;
 
 
@@ -66,6 +194,16 @@ int main(int argc, char **argv) {
         cerr << desc;
         return 1;
     }
+    CHECK(threads >= 1);
+    CHECK(encoders >= 1);
+    bool flip = vm.count("flip") > 0;
+    bool tta = flip || !tta_scales.empty();
+    if (tta_scales.empty()) tta_scales.push_back(1);
+    bool use_cascade = cascade.scale < 1;
+    CHECK(!(tta && use_cascade)) << "--cascade cannot be combined with --scales or --flip";
+    // the model outputs background probabilities, see below
+    cascade.th = b_th;
+    cascade.invert = true;
 
     if (ipaths.empty()) {
         string line;
@@ -74,48 +212,68 @@ int main(int argc, char **argv) {
         }
     }
 
-    caffex::Caffex det(model);
-    BBoxDetector bdet(b_th, b_keep, b_sth);
-
-    unsigned cnt = 0;
     fs::create_directories(odir);
-    for (auto const &path: ipaths) {
-        cv::Mat ret;
-        cv::Mat input = cv::imread(path.native(), CV_LOAD_IMAGE_COLOR);
-        BOOST_VERIFY(input.data);
-        if (max > 0) {
-            cv::Mat tmp;
-            LimitSize(input, max, &tmp);
-            input = tmp;
-        }
-        vector<float> resp;
-        det.apply(input, &resp);
-        for (auto &v: resp) {
-            v = 1.0 - v;
-        }
-        cv::Mat fl;
-        input.convertTo(fl, CV_32FC3);
-        cv::Mat prob(input.size(), CV_32F, &resp[0]);
-        vector<BBox> boxes;
-        bdet.apply(prob, &boxes);
-
-        vector<cv::Mat> chs{prob, prob, prob};
-        cv::Mat prob3d;
-        cv::merge(&chs[0], 3, prob3d);
-        cv::Mat mask = fl.mul(prob3d);
-        prob3d *= 255;
-        float best = 0;
-        for (auto const &box: boxes) {
-            if (box.score > best) best = box.score;
-            cv::rectangle(prob3d, box.box, cv::Scalar(0, 0, 0xFF), 2);
-            cv::rectangle(mask, box.box, cv::Scalar(0, 0, 0xFF), 2);
-            cv::rectangle(fl, box.box, cv::Scalar(0, 0, 0xFF), 2);
-        }
-        cout << path << '\t' << best << endl;
-        cv::hconcat(mask, prob3d, mask);
-        cv::hconcat(mask, fl, fl);
-        cv::imwrite((odir/(lexical_cast<string>(cnt++)+".jpg")).native(), fl);
+    caffex::BBoxDetector bdet(b_th, b_keep, b_sth);
+    // each detector thread loads, runs and renders images in turn, so
+    // decoding on one thread overlaps inference on the others
+    std::atomic<unsigned> next(0);
+    Writer writer(odir, encoders, threads * 4);
+    vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; ++t) {
+        workers.emplace_back([&]() {
+            // Net is not thread-safe
+            caffex::Caffex det(model);
+            vector<float> resp;
+            vector<caffex::BBox> boxes;
+            for (;;) {
+                unsigned cnt = next++;
+                if (cnt >= ipaths.size()) break;
+                fs::path const &path = ipaths[cnt];
+                Job job;
+                job.index = cnt;
+                cv::Mat input = cv::imread(path.native(), CV_LOAD_IMAGE_COLOR);
+                if (!input.data) {
+                    LOG(ERROR) << "failed to load " << path;
+                    writer.push(std::move(job));
+                    continue;
+                }
+                if (max > 0) {
+                    cv::Mat tmp;
+                    LimitSize(input, max, &tmp);
+                    input = tmp;
+                }
+                if (tta) {
+                    det.apply_tta(input, tta_scales, flip, &resp);
+                }
+                else if (use_cascade) {
+                    det.apply_cascade(input, cascade, &resp);
+                }
+                else {
+                    det.apply(input, &resp);
+                }
+                for (auto &v: resp) {
+                    v = 1.0 - v;
+                }
+                cv::Mat prob(input.size(), CV_32F, &resp[0]);
+                bdet.apply(prob, &boxes);
+                Overlay(input, prob, &job.vis);
+                float best = 0;
+                for (auto const &box: boxes) {
+                    if (box.score > best) best = box.score;
+                    for (int i = 0; i < 3; ++i) {
+                        cv::Mat panel = job.vis(cv::Rect(i * input.cols, 0, input.cols, input.rows));
+                        cv::rectangle(panel, box.box, cv::Scalar(0, 0, 0xFF), 2);
+                    }
+                }
+                std::ostringstream ss;
+                ss << path << '\t' << best << '\t' << caffex::BBoxDetector::json(boxes, prob.size());
+                job.line = ss.str();
+                writer.push(std::move(job));
+            }
+        });
+    }
+    for (auto &th: workers) {
+        th.join();
     }
     return 0;
 }
-
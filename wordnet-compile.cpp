@@ -0,0 +1,65 @@
+#include <iostream>
+#include <boost/program_options.hpp>
+#include <glog/logging.h>
+#include "wordnet.h"
+
+using namespace std;
+
+int main(int argc, char **argv) {
+    namespace po = boost::program_options; 
+    string input_path;
+    string output_path;
+    vector<string> queries;
+
+    po::options_description desc("Allowed options");
+    desc.add_options()
+    ("help,h", "produce help message.")
+    ("input", po::value(&input_path), "wordnet in text format")
+    ("output", po::value(&output_path), "compiled index")
+    ("lca", po::value(&queries)->multitoken(), "print the lowest common ancestor of two wnids with the compiled index")
+    ;
+
+    po::positional_options_description p;
+    p.add("input", 1);
+    p.add("output", 1);
+
+    po::variables_map vm;
+    po::store(po::command_line_parser(argc, argv).
+                     options(desc).positional(p).run(), vm);
+    po::notify(vm); 
+
+    if (vm.count("help") || input_path.empty() || output_path.empty()) {
+        cerr << desc;
+        return 1;
+    }
+    google::InitGoogleLogging(argv[0]);
+
+    {
+        caffex::WordNet wn(input_path);
+        caffex::WordNetIndex::compile(wn, output_path);
+    }
+    caffex::WordNetIndex index(output_path);
+    size_t ancestors = 0;
+    unsigned depth = 0;
+    for (unsigned i = 0; i < index.size(); ++i) {
+        ancestors += index.ancestors(i).size();
+        depth = std::max(depth, index.depth(i));
+    }
+    cerr << index.size() << " synsets, " << ancestors << " ancestor entries, depth " << depth << endl;
+
+    if (queries.size()) {
+        CHECK(queries.size() == 2) << "--lca takes two wnids";
+        int a = index.find(queries[0]);
+        int b = index.find(queries[1]);
+        CHECK(a >= 0) << "unknown wnid " << queries[0];
+        CHECK(b >= 0) << "unknown wnid " << queries[1];
+        int c = index.lca(a, b);
+        if (c < 0) {
+            cout << "none" << endl;
+        }
+        else {
+            cout << index.wnid(c) << '\t' << index.text(c) << endl;
+        }
+    }
+    return 0;
+}
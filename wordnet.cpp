@@ -0,0 +1,180 @@
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <glog/logging.h>
+#include "wordnet.h"
+
+namespace caffex {
+
+static char const MAGIC[8] = {'C', 'X', 'W', 'N', 'E', 'T', '1', 0};
+
+WordNetIndex::WordNetIndex (string const &path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    PCHECK(fd >= 0) << "cannot open " << path;
+    struct stat st;
+    PCHECK(::fstat(fd, &st) == 0);
+    data_size = st.st_size;
+    CHECK(data_size >= sizeof(Header)) << "bad wordnet index " << path;
+    void *p = ::mmap(NULL, data_size, PROT_READ, MAP_SHARED, fd, 0);
+    PCHECK(p != MAP_FAILED) << "cannot mmap " << path;
+    ::close(fd);
+    data = reinterpret_cast<char const *>(p);
+    header = reinterpret_cast<Header const *>(data);
+    CHECK(std::memcmp(header->magic, MAGIC, sizeof(MAGIC)) == 0) << "bad wordnet index " << path;
+    size_t n = header->size;
+    uint32_t const *u = reinterpret_cast<uint32_t const *>(header + 1);
+    wnids = u; u += n;
+    texts = u; u += n;
+    by_wnid = u; u += n;
+    depths = u; u += n;
+    parent_off = u; u += n + 1;
+    parent_ids = u; u += header->n_parents;
+    child_off = u; u += n + 1;
+    child_ids = u; u += header->n_children;
+    ancestor_off = u; u += n + 1;
+    ancestor_ids = u; u += header->n_ancestors;
+    pool = reinterpret_cast<char const *>(u);
+    CHECK(size_t(pool - data) + header->pool_size == data_size) << "bad wordnet index " << path;
+}
+
+WordNetIndex::~WordNetIndex () {
+    ::munmap(const_cast<char *>(data), data_size);
+}
+
+bool WordNetIndex::is_ancestor (unsigned a, unsigned b) const {
+    Span s = ancestors(b);
+    return std::binary_search(s.begin(), s.end(), uint32_t(a));
+}
+
+int WordNetIndex::lca (unsigned a, unsigned b) const {
+    if (a == b) return a;
+    if (is_ancestor(a, b)) return a;
+    if (is_ancestor(b, a)) return b;
+    Span sa = ancestors(a), sb = ancestors(b);
+    uint32_t const *i = sa.begin(), *j = sb.begin();
+    int best = -1;
+    while ((i < sa.end()) && (j < sb.end())) {
+        if (*i < *j) ++i;
+        else if (*j < *i) ++j;
+        else {
+            if ((best < 0) || (depths[*i] > depths[best])) best = *i;
+            ++i;
+            ++j;
+        }
+    }
+    return best;
+}
+
+int WordNetIndex::find (string const &wnid) const {
+    uint32_t const *e = by_wnid + size();
+    uint32_t const *it = std::lower_bound(by_wnid, e, wnid,
+            [this](uint32_t i, string const &w) {
+                return std::strcmp(pool + wnids[i], w.c_str()) < 0;
+            });
+    if ((it < e) && (wnid == pool + wnids[*it])) return *it;
+    return -1;
+}
+
+namespace {
+    // ancestors and depth of each synset, memoized depth first
+    struct Closure {
+        WordNet const &wn;
+        vector<vector<uint32_t>> ancestors;
+        vector<uint32_t> depth;
+        vector<char> state;     // 0: new, 1: visiting, 2: done
+
+        Closure (WordNet const &wn_): wn(wn_), ancestors(wn.size()), depth(wn.size(), 0), state(wn.size(), 0) {
+            for (unsigned i = 0; i < wn.size(); ++i) {
+                visit(i);
+            }
+        }
+        void visit (unsigned i) {
+            if (state[i] == 2) return;
+            CHECK(state[i] == 0) << "cycle in wordnet at " << wn[i].wnid;
+            state[i] = 1;
+            vector<uint32_t> &anc = ancestors[i];
+            for (unsigned p: wn[i].parents) {
+                CHECK(p < wn.size()) << "bad parent of " << wn[i].wnid;
+                visit(p);
+                anc.push_back(p);
+                anc.insert(anc.end(), ancestors[p].begin(), ancestors[p].end());
+                depth[i] = std::max(depth[i], depth[p] + 1);
+            }
+            std::sort(anc.begin(), anc.end());
+            anc.erase(std::unique(anc.begin(), anc.end()), anc.end());
+            state[i] = 2;
+        }
+    };
+
+    void append_csr (vector<vector<uint32_t>> const &lists, vector<uint32_t> *off, vector<uint32_t> *ids) {
+        off->push_back(0);
+        for (auto const &l: lists) {
+            ids->insert(ids->end(), l.begin(), l.end());
+            off->push_back(ids->size());
+        }
+    }
+
+    void write (FILE *f, vector<uint32_t> const &v) {
+        CHECK(fwrite(&v[0], sizeof(uint32_t), v.size(), f) == v.size());
+    }
+}
+
+void WordNetIndex::compile (WordNet const &wn, string const &path) {
+    unsigned n = wn.size();
+    CHECK(n > 0) << "empty wordnet";
+    Closure closure(wn);
+    string pool;
+    vector<uint32_t> wnids(n), texts(n), by_wnid(n);
+    for (unsigned i = 0; i < n; ++i) {
+        wnids[i] = pool.size();
+        pool.append(wn[i].wnid);
+        pool.push_back(0);
+        texts[i] = pool.size();
+        pool.append(wn[i].text);
+        pool.push_back(0);
+        by_wnid[i] = i;
+    }
+    std::sort(by_wnid.begin(), by_wnid.end(), [&wn](uint32_t a, uint32_t b) {
+        return wn[a].wnid < wn[b].wnid;
+    });
+    vector<vector<uint32_t>> parents(n), children(n);
+    for (unsigned i = 0; i < n; ++i) {
+        parents[i].assign(wn[i].parents.begin(), wn[i].parents.end());
+        children[i].assign(wn[i].children.begin(), wn[i].children.end());
+    }
+    vector<uint32_t> parent_off, parent_ids, child_off, child_ids, ancestor_off, ancestor_ids;
+    append_csr(parents, &parent_off, &parent_ids);
+    append_csr(children, &child_off, &child_ids);
+    append_csr(closure.ancestors, &ancestor_off, &ancestor_ids);
+
+    Header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.size = n;
+    header.n_parents = parent_ids.size();
+    header.n_children = child_ids.size();
+    header.n_ancestors = ancestor_ids.size();
+    header.pool_size = pool.size();
+
+    FILE *f = fopen(path.c_str(), "wb");
+    PCHECK(f) << "cannot create " << path;
+    CHECK(fwrite(&header, sizeof(header), 1, f) == 1);
+    write(f, wnids);
+    write(f, texts);
+    write(f, by_wnid);
+    write(f, closure.depth);
+    write(f, parent_off);
+    if (parent_ids.size()) write(f, parent_ids);
+    write(f, child_off);
+    if (child_ids.size()) write(f, child_ids);
+    write(f, ancestor_off);
+    if (ancestor_ids.size()) write(f, ancestor_ids);
+    CHECK(fwrite(pool.data(), 1, pool.size(), f) == pool.size());
+    PCHECK(fclose(f) == 0);
+}
+
+}
@@ -2,6 +2,7 @@
 #include <string>
 #include <vector>
 #include <fstream>
+#include <cstdint>
 
 namespace caffex {
     using std::string;
@@ -17,6 +18,8 @@ namespace caffex {
         };
     };
 
+    // Text format, one synset per line:
+    //      wnid #parents parent ... text
     class WordNet: public WordNetBase, public vector<WordNetBase::Entry> {
     public:
         WordNet (string const &path) {
@@ -41,4 +44,88 @@ namespace caffex {
             }
         }
     };
+
+    // Compiled WordNet, produced from the text format by wordnet-compile
+    // and loaded with a single mmap.  The file holds a string pool and
+    // CSR arrays of parents, children and all ancestors of each synset;
+    // ancestor lists are sorted, so is_ancestor is a binary search and
+    // the common ancestors of two synsets are a merge of two short lists.
+    class WordNetIndex {
+    public:
+        struct Span {
+            uint32_t const *b;
+            uint32_t const *e;
+            uint32_t const *begin () const { return b; }
+            uint32_t const *end () const { return e; }
+            size_t size () const { return e - b; }
+            bool empty () const { return b == e; }
+        };
+
+        WordNetIndex (string const &path);
+        ~WordNetIndex ();
+        static void compile (WordNet const &wn, string const &path);
+
+        unsigned size () const {
+            return header->size;
+        }
+        char const *wnid (unsigned i) const {
+            return pool + wnids[i];
+        }
+        char const *text (unsigned i) const {
+            return pool + texts[i];
+        }
+        // longest path to a root, so every ancestor is shallower
+        unsigned depth (unsigned i) const {
+            return depths[i];
+        }
+        Span parents (unsigned i) const {
+            return span(parent_off, parent_ids, i);
+        }
+        Span children (unsigned i) const {
+            return span(child_off, child_ids, i);
+        }
+        // all proper ancestors, sorted by id
+        Span ancestors (unsigned i) const {
+            return span(ancestor_off, ancestor_ids, i);
+        }
+        // a is a proper ancestor of b
+        bool is_ancestor (unsigned a, unsigned b) const;
+        // the deepest synset that is a or an ancestor of a and also b or
+        // an ancestor of b, -1 if they are in different trees
+        int lca (unsigned a, unsigned b) const;
+        // synset of wnid, -1 if not found
+        int find (string const &wnid) const;
+
+    private:
+        struct Header {
+            char magic[8];
+            uint32_t size;
+            uint32_t n_parents;
+            uint32_t n_children;
+            uint32_t n_ancestors;
+            uint32_t pool_size;
+            uint32_t reserved;
+        };
+        char const *data;
+        size_t data_size;
+        Header const *header;
+        uint32_t const *wnids;          // pool offsets
+        uint32_t const *texts;
+        uint32_t const *by_wnid;        // ids sorted by wnid
+        uint32_t const *depths;
+        uint32_t const *parent_off;     // size + 1 entries
+        uint32_t const *parent_ids;
+        uint32_t const *child_off;
+        uint32_t const *child_ids;
+        uint32_t const *ancestor_off;
+        uint32_t const *ancestor_ids;
+        char const *pool;
+
+        static Span span (uint32_t const *off, uint32_t const *ids, unsigned i) {
+            Span s;
+            s.b = ids + off[i];
+            s.e = ids + off[i + 1];
+            return s;
+        }
+    };
 }